@@ -0,0 +1,61 @@
+-- cdata arithmetic and comparisons
+
+local ffi = require("cffi")
+
+bench("arith.int64_add", 1000000, function(n)
+    local a = ffi.new("long long", 5)
+    for i = 1, n do local x = a + i end
+end)
+
+bench("arith.int64_mul", 1000000, function(n)
+    local a = ffi.new("long long", 5)
+    local b = ffi.new("long long", 7)
+    for i = 1, n do local x = a * b end
+end)
+
+bench("arith.uint64_cmp", 2000000, function(n)
+    local a = ffi.new("unsigned long long", 5)
+    local b = ffi.new("unsigned long long", 7)
+    for i = 1, n do local x = a < b end
+end)
+
+bench("arith.ptr_add", 1000000, function(n)
+    local a = ffi.new("int[16]")
+    local p = ffi.cast("int *", a)
+    for i = 1, n do local x = p + 4 end
+end)
+
+bench("arith.ptr_diff", 2000000, function(n)
+    local a = ffi.new("int[16]")
+    local p1 = ffi.cast("int *", a)
+    local p2 = p1 + 8
+    for i = 1, n do local x = p2 - p1 end
+end)
+
+bench("arith.ptr_eq", 2000000, function(n)
+    local a = ffi.new("int[16]")
+    local p1 = ffi.cast("int *", a)
+    local p2 = ffi.cast("int *", a)
+    for i = 1, n do local x = p1 == p2 end
+end)
+
+ffi.cdef [[
+    typedef struct bench_vec2 { double x, y; } bench_vec2;
+]]
+
+local vec2 = ffi.metatype("bench_vec2", {
+    __add = function(a, b) return a end,
+    __eq = function(a, b) return a.x == b.x end,
+})
+
+bench("arith.metatype_add", 1000000, function(n)
+    local a = vec2(1, 2)
+    local b = vec2(3, 4)
+    for i = 1, n do local x = a + b end
+end)
+
+bench("arith.metatype_eq", 1000000, function(n)
+    local a = vec2(1, 2)
+    local b = vec2(3, 4)
+    for i = 1, n do local x = a == b end
+end)
@@ -0,0 +1,57 @@
+-- function call overhead (call_cif and argument conversions)
+
+local ffi = require("cffi")
+
+ffi.cdef [[
+    void bench_nop(void);
+    int bench_add(int a, int b);
+    double bench_addd(double a, double b);
+    size_t bench_strlen(char const *str);
+    int bench_call_cb(int (*cb)(int), int v);
+    int snprintf(char *buf, size_t n, char const *fmt, ...);
+]]
+
+local C = ffi.C
+
+bench("call.nop", 2000000, function(n)
+    local f = C.bench_nop
+    for i = 1, n do f() end
+end)
+
+bench("call.int", 2000000, function(n)
+    local f = C.bench_add
+    for i = 1, n do f(i, 2) end
+end)
+
+bench("call.double", 2000000, function(n)
+    local f = C.bench_addd
+    for i = 1, n do f(i, 0.5) end
+end)
+
+bench("call.cdata_arg", 2000000, function(n)
+    local f = C.bench_add
+    local a = ffi.new("int", 5)
+    for i = 1, n do f(a, a) end
+end)
+
+bench("call.string", 2000000, function(n)
+    local f = C.bench_strlen
+    for i = 1, n do f("hello world") end
+end)
+
+bench("call.variadic", 500000, function(n)
+    local f = C.snprintf
+    local buf = ffi.new("char[64]")
+    for i = 1, n do f(buf, 64, "%d", ffi.new("int", i)) end
+end)
+
+bench("call.callback", 500000, function(n)
+    local f = C.bench_call_cb
+    local cb = ffi.cast("int (*)(int)", function(v) return v + 1 end)
+    for i = 1, n do f(cb, i) end
+    cb:free()
+end)
+
+bench("call.lookup", 2000000, function(n)
+    for i = 1, n do local f = C.bench_nop end
+end)
@@ -0,0 +1,115 @@
+-- conversions between lua values and cdata (from_lua, to_lua, tables)
+
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct bench_point {
+        int x, y;
+        double z;
+    };
+]]
+
+bench("convert.new_scalar", 1000000, function(n)
+    local ct = ffi.typeof("int")
+    for i = 1, n do local x = ffi.new(ct, i) end
+end)
+
+bench("convert.new_string_type", 1000000, function(n)
+    for i = 1, n do local x = ffi.new("int", i) end
+end)
+
+bench("convert.tonumber", 2000000, function(n)
+    local a = ffi.new("double", 1.5)
+    for i = 1, n do local x = ffi.tonumber(a) end
+end)
+
+bench("convert.cast", 1000000, function(n)
+    local ct = ffi.typeof("int *")
+    for i = 1, n do local x = ffi.cast(ct, nil) end
+end)
+
+bench("convert.string", 1000000, function(n)
+    local s = ffi.new("char[16]")
+    ffi.copy(s, "hello world")
+    for i = 1, n do local x = ffi.string(s) end
+end)
+
+bench("convert.table_struct", 500000, function(n)
+    local ct = ffi.typeof("struct bench_point")
+    local t = { x = 1, y = 2, z = 3 }
+    for i = 1, n do local x = ffi.new(ct, t) end
+end)
+
+local t64 = {}
+for i = 1, 64 do t64[i] = i end
+
+bench("convert.table_array64", 200000, function(n)
+    local ct = ffi.typeof("double[64]")
+    for i = 1, n do local x = ffi.new(ct, t64) end
+end)
+
+bench("convert.fromtable64", 500000, function(n)
+    local a = ffi.new("double[64]")
+    for i = 1, n do ffi.fromtable(a, t64) end
+end)
+
+bench("convert.totable64", 200000, function(n)
+    local a = ffi.new("double[64]", t64)
+    for i = 1, n do local x = ffi.totable(a) end
+end)
+
+bench("convert.new_array256", 500000, function(n)
+    local ct = ffi.typeof("double[256]")
+    for i = 1, n do local x = ffi.new(ct) end
+end)
+
+bench("convert.arena_array256", 500000, function(n)
+    local ct = ffi.typeof("double[256]")
+    local ar = ffi.arena()
+    for i = 1, n do
+        local x = ar:new(ct)
+        if (i % 64) == 0 then ar:reset() end
+    end
+end)
+
+ffi.cdef [[
+    void *malloc(size_t n);
+    void free(void *p);
+]]
+
+bench("convert.gc_free", 500000, function(n)
+    local C = ffi.C
+    local malloc, free = C.malloc, C.free
+    for i = 1, n do ffi.gc(malloc(16), free) end
+    collectgarbage()
+end)
+
+bench("convert.gc_lua_free", 500000, function(n)
+    local C = ffi.C
+    local malloc, free = C.malloc, C.free
+    local fin = function(p) free(p) end
+    for i = 1, n do ffi.gc(malloc(16), fin) end
+    collectgarbage()
+end)
+
+bench("convert.new_8m", 200, function(n)
+    local ct = ffi.typeof("uint8_t[?]")
+    for i = 1, n do local x = ffi.new(ct, 8 * 1024 * 1024) end
+end)
+
+bench("convert.new_uninit_64k", 200000, function(n)
+    local ct = ffi.typeof("uint8_t[?]")
+    for i = 1, n do local x = ffi.new_uninit(ct, 65536) end
+end)
+
+bench("convert.new_struct", 1000000, function(n)
+    local ct = ffi.typeof("struct { int x, y; }")
+    for i = 1, n do local x = ffi.new(ct) end
+end)
+
+bench("convert.new_struct_stats", 1000000, function(n)
+    local ct = ffi.typeof("struct { int x, y; }")
+    ffi.stats(true)
+    for i = 1, n do local x = ffi.new(ct) end
+    ffi.stats(false)
+end)
@@ -0,0 +1,68 @@
+-- indexing cdata (index_common, field lookups, array access)
+
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct bench_point {
+        int x, y;
+        double z;
+    };
+    struct bench_line {
+        struct bench_point a, b;
+    };
+]]
+
+bench("index.field_get", 2000000, function(n)
+    local p = ffi.new("struct bench_point", 1, 2, 3)
+    local s = 0
+    for i = 1, n do s = s + p.z end
+end)
+
+bench("index.field_set", 2000000, function(n)
+    local p = ffi.new("struct bench_point")
+    for i = 1, n do p.x = i end
+end)
+
+bench("index.ptr_field_get", 2000000, function(n)
+    local p = ffi.new("struct bench_point", 1, 2, 3)
+    local pp = ffi.cast("struct bench_point *", p)
+    local s = 0
+    for i = 1, n do s = s + pp.z end
+end)
+
+bench("index.array_get", 2000000, function(n)
+    local a = ffi.new("double[16]")
+    local s = 0
+    for i = 1, n do s = s + a[i % 16] end
+end)
+
+bench("index.array_set", 2000000, function(n)
+    local a = ffi.new("double[16]")
+    for i = 1, n do a[i % 16] = i end
+end)
+
+bench("index.ptr_get", 2000000, function(n)
+    local a = ffi.new("int[16]")
+    local p = ffi.cast("int *", a)
+    local s = 0
+    for i = 1, n do s = s + p[i % 16] end
+end)
+
+bench("index.nested_get", 2000000, function(n)
+    local l = ffi.new("struct bench_line")
+    local s = 0
+    for i = 1, n do s = s + l.b.z end
+end)
+
+bench("index.nested_field_get", 2000000, function(n)
+    local l = ffi.new("struct bench_line")
+    local bz = ffi.field("struct bench_line", "b.z")
+    local s = 0
+    for i = 1, n do s = s + bz:get(l) end
+end)
+
+bench("index.nested_field_set", 2000000, function(n)
+    local l = ffi.new("struct bench_line")
+    local bx = ffi.field("struct bench_line", "b.x")
+    for i = 1, n do bx:set(l, i) end
+end)
@@ -0,0 +1,76 @@
+-- declaration parsing (parser::parse) and type string lookups
+
+local ffi = require("cffi")
+
+local decls = [[
+    typedef struct bench_node_%d {
+        struct bench_node_%d *next;
+        int kind;
+        unsigned flags;
+        double weight;
+        char const *name;
+        union {
+            long long i;
+            double d;
+        } value;
+    } bench_node_%d_t;
+    enum bench_kind_%d { BENCH_A_%d, BENCH_B_%d = 5, BENCH_C_%d };
+    int bench_func_%d(bench_node_%d_t const *node, int (*cb)(void *), ...);
+]]
+
+local id = 0
+bench("parse.cdef", 20000, function(n)
+    for i = 1, n do
+        id = id + 1
+        ffi.cdef((decls:gsub("%%d", tostring(id))))
+    end
+end)
+
+bench("parse.typeof_cached", 1000000, function(n)
+    for i = 1, n do local x = ffi.typeof("struct bench_node_1 *") end
+end)
+
+bench("parse.typeof_uncached", 100000, function(n)
+    for i = 1, n do
+        local x = ffi.typeof("int (*)(double, bench_node_1_t *)["
+            .. (i % 1024 + 1) .. "]")
+    end
+end)
+
+-- a larger header in the usual style, with comments and indentation; it
+-- only has prototypes and externs, which may be declared again and again
+ffi.cdef [[
+    typedef struct bench_hdr bench_hdr_t;
+]]
+
+local hdr = {}
+for i = 1, 250 do
+    hdr[#hdr + 1] = ([[
+/*
+ * bench_hdr_op_%d:
+ *
+ * Performs operation number %d on the given handle, writing at most
+ * `len` bytes of output into `buf`; returns the number of bytes written,
+ * or a negative error code.
+ */
+extern int bench_hdr_op_%d(
+    bench_hdr_t *handle,    /* the handle */
+    unsigned char *buf,     /* output buffer */
+    size_t len,             /* its size */
+    unsigned long long flags
+);
+
+// the callback variant, for asynchronous use
+void bench_hdr_op_%d_async(bench_hdr_t *handle, void (*cb)(int, void *),
+                           void *data);
+extern char const *const bench_hdr_name_%d;
+
+]]):gsub("%%d", tostring(i))
+end
+local header = table.concat(hdr)
+
+bench("parse.header", 200, function(n)
+    for i = 1, n do
+        ffi.cdef(header)
+    end
+end)
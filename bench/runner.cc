@@ -0,0 +1,207 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <new>
+
+#include <lua.hh>
+
+#ifdef FFI_WINDOWS_ABI
+#  define DLL_EXPORT __declspec(dllexport)
+#else
+#  if defined(__GNUC__) && (__GNUC__ >= 4)
+#    define DLL_EXPORT __attribute__((visibility("default")))
+#  else
+#    define DLL_EXPORT
+#  endif
+#endif
+
+#ifdef CFFI_STATIC
+extern "C" int luaopen_cffi(lua_State *L);
+#endif
+
+/* Fixture functions for the benchmarks; they are kept trivial on purpose,
+ * so that what gets measured is the cost of getting through the FFI.
+ */
+
+struct bench_point {
+    int x, y;
+    double z;
+};
+
+extern "C" DLL_EXPORT
+void bench_nop(void) {}
+
+extern "C" DLL_EXPORT
+int bench_add(int a, int b) {
+    return a + b;
+}
+
+extern "C" DLL_EXPORT
+double bench_addd(double a, double b) {
+    return a + b;
+}
+
+extern "C" DLL_EXPORT
+size_t bench_strlen(char const *str) {
+    return strlen(str);
+}
+
+extern "C" DLL_EXPORT
+int bench_point_sum(bench_point const *p) {
+    return p->x + p->y;
+}
+
+extern "C" DLL_EXPORT
+double bench_sum(double const *arr, size_t n) {
+    double ret = 0;
+    for (size_t i = 0; i < n; ++i) {
+        ret += arr[i];
+    }
+    return ret;
+}
+
+extern "C" DLL_EXPORT
+int bench_call_cb(int (*cb)(int), int v) {
+    return cb(v);
+}
+
+/* allocation counting; every fresh block or growing reallocation done
+ * through the state allocator is counted, plus everything that goes through
+ * the global operator new (which the module picks up from here as long as
+ * the platform resolves it globally, i.e. not on Windows)
+ */
+
+static size_t bench_nallocs = 0;
+static size_t bench_nnew = 0;
+
+void *operator new(std::size_t n) {
+    ++bench_nnew;
+    void *ret = malloc(n ? n : 1);
+    if (!ret) {
+        throw std::bad_alloc{};
+    }
+    return ret;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    free(p);
+}
+
+static void *bench_alloc(void *, void *ptr, size_t osize, size_t nsize) {
+    if (!nsize) {
+        free(ptr);
+        return nullptr;
+    }
+    if (!ptr || (nsize > osize)) {
+        ++bench_nallocs;
+    }
+    return realloc(ptr, nsize);
+}
+
+static double bench_scale = 1.0;
+
+/* bench(name, iters, func)
+ *
+ * calls func(iters) once for warmup with a fraction of the iterations and
+ * then once for real; the function is expected to do the loop itself, so
+ * that the call into it does not get measured
+ *
+ * prints one line of JSON per benchmark
+ */
+static int bench_run(lua_State *L) {
+    char const *name = luaL_checkstring(L, 1);
+    auto iters = lua_Integer(double(luaL_checkinteger(L, 2)) * bench_scale);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    if (iters < 1) {
+        iters = 1;
+    }
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, (iters / 10) + 1);
+    lua_call(L, 1, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, iters);
+    size_t nallocs = bench_nallocs;
+    size_t nnew = bench_nnew;
+    auto start = std::chrono::steady_clock::now();
+    lua_call(L, 1, 0);
+    auto end = std::chrono::steady_clock::now();
+    nallocs = bench_nallocs - nallocs;
+    nnew = bench_nnew - nnew;
+
+    double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start
+    ).count());
+    printf(
+        "{\"name\": \"%s\", \"iters\": %lld, \"ns_per_op\": %.2f, "
+        "\"allocs_per_op\": %.2f, \"heap_allocs_per_op\": %.2f}\n",
+        name, static_cast<long long>(iters), ns / double(iters),
+        double(nallocs) / double(iters), double(nnew) / double(iters)
+    );
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("not enough arguments (%d)\n", argc);
+        return 1;
+    }
+    /* allow shorter or longer runs without touching the scripts */
+    char const *scale = getenv("CFFI_BENCH_SCALE");
+    if (scale) {
+        bench_scale = atof(scale);
+        if (bench_scale <= 0) {
+            bench_scale = 1.0;
+        }
+    }
+    /* set up a lua state */
+    auto L = lua_newstate(bench_alloc, nullptr);
+    if (!L) {
+        printf("failed creating a lua state\n");
+        return 1;
+    }
+    luaL_openlibs(L);
+    /* we need a controlled environment */
+    lua_getglobal(L, "package");
+#ifdef CFFI_STATIC
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, luaopen_cffi);
+    lua_setfield(L, -2, "cffi");
+    lua_pop(L, 1);
+#else
+    lua_pushstring(L, argv[1]);
+    lua_pushstring(L, LUA_DIRSEP);
+#ifdef FFI_WINDOWS_ABI
+    lua_pushstring(L, "?.dll");
+#else
+    lua_pushstring(L, "?.so");
+#endif
+    lua_concat(L, 3);
+    lua_setfield(L, -2, "cpath");
+#endif
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, bench_run);
+    lua_setglobal(L, "bench");
+
+    /* load benchmark */
+    if (luaL_loadfile(L, argv[2]) != 0) {
+        printf("failed loading file '%s': %s\n", argv[2], lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+    if (lua_pcall(L, 0, 0, 0) != 0) {
+        printf("benchmark failed: %s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include "arena.hh"
+
+namespace util {
+
+/* chunks start small, since many states only ever declare a few things,
+ * and double up to the maximum; anything large gets a chunk of its own
+ */
+static constexpr std::size_t CHUNK_MIN = 4096;
+static constexpr std::size_t CHUNK_MAX = 65536;
+
+static inline char *align_up(char *p, std::size_t align) {
+    auto v = reinterpret_cast<std::uintptr_t>(p);
+    v = (v + align - 1) & ~std::uintptr_t(align - 1);
+    return reinterpret_cast<char *>(v);
+}
+
+/* chunk data starts maximally aligned */
+static constexpr std::size_t CHUNK_HSIZE = (
+    sizeof(void *) * 2 + alignof(std::max_align_t) - 1
+) & ~(alignof(std::max_align_t) - 1);
+
+void *arena::alloc(std::size_t size, std::size_t align) {
+    static_assert(sizeof(chunk) <= CHUNK_HSIZE, "bad chunk header size");
+    char *ret = align_up(p_cur, align);
+    if (p_cur && (ret <= p_end) && (size <= std::size_t(p_end - ret))) {
+        p_used += std::size_t(ret - p_cur) + size;
+        p_cur = ret + size;
+        return ret;
+    }
+    std::size_t need = size + align;
+    /* chunks kept by a reset come first, any big enough one will do */
+    for (chunk **pc = &p_free; *pc; pc = &(*pc)->next) {
+        auto *c = *pc;
+        if (c->size < need) {
+            continue;
+        }
+        *pc = c->next;
+        c->next = p_chunks;
+        p_chunks = c;
+        char *data = reinterpret_cast<char *>(c) + CHUNK_HSIZE;
+        ret = align_up(data, align);
+        p_used += std::size_t(ret - data) + size;
+        p_cur = ret + size;
+        p_end = data + c->size;
+        return ret;
+    }
+    std::size_t csize = p_chunks ? (p_chunks->size * 2) : CHUNK_MIN;
+    if (csize > CHUNK_MAX) {
+        csize = CHUNK_MAX;
+    }
+    bool own = (need > (csize / 4));
+    if (own) {
+        csize = need;
+    }
+    auto *c = static_cast<chunk *>(std::malloc(CHUNK_HSIZE + csize));
+    if (!c) {
+        throw std::bad_alloc{};
+    }
+    c->size = csize;
+    char *data = reinterpret_cast<char *>(c) + CHUNK_HSIZE;
+    p_size += csize;
+    ++p_nchunks;
+    ret = align_up(data, align);
+    p_used += size;
+    if (own && p_chunks) {
+        /* keep bumping in the current chunk */
+        c->next = p_chunks->next;
+        p_chunks->next = c;
+        return ret;
+    }
+    c->next = p_chunks;
+    p_chunks = c;
+    p_cur = ret + size;
+    p_end = data + csize;
+    return ret;
+}
+
+void arena::add_dtor(void *ptr, void (*func)(void *)) {
+    auto *d = static_cast<dtor *>(alloc(sizeof(dtor), alignof(dtor)));
+    d->func = func;
+    d->ptr = ptr;
+    d->next = p_dtors;
+    p_dtors = d;
+}
+
+void arena::reset() {
+    for (auto *d = p_dtors; d; d = d->next) {
+        d->func(d->ptr);
+    }
+    p_dtors = nullptr;
+    while (p_chunks) {
+        auto *c = p_chunks;
+        p_chunks = c->next;
+        c->next = p_free;
+        p_free = c;
+    }
+    p_cur = p_end = nullptr;
+    p_used = 0;
+}
+
+void arena::clear() {
+    reset();
+    while (p_free) {
+        auto *c = p_free;
+        p_free = c->next;
+        std::free(c);
+    }
+    p_size = p_nchunks = 0;
+}
+
+} /* namespace util */
@@ -0,0 +1,86 @@
+#ifndef ARENA_HH
+#define ARENA_HH
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+/* A bump allocator. Memory is carved out of larger chunks in order and is
+ * only ever released all at once, when the arena is cleared or destroyed,
+ * so things allocated together end up next to each other and there is no
+ * per-object allocation overhead. Objects which need destruction have
+ * their destructors called at that point, newest first.
+ */
+
+namespace util {
+
+struct arena {
+    struct stats {
+        std::size_t used; /* bytes handed out, including padding */
+        std::size_t size; /* bytes held in chunks */
+        std::size_t chunks;
+    };
+
+    arena() {}
+    arena(arena const &) = delete;
+    arena &operator=(arena const &) = delete;
+
+    ~arena() {
+        clear();
+    }
+
+    void *alloc(
+        std::size_t size, std::size_t align = alignof(std::max_align_t)
+    );
+
+    template<typename T, typename ...A>
+    T *make(A &&...args) {
+        void *mem = alloc(sizeof(T), alignof(T));
+        T *ret = new (mem) T(std::forward<A>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            add_dtor(ret, [](void *p) {
+                static_cast<T *>(p)->~T();
+            });
+        }
+        return ret;
+    }
+
+    void clear();
+
+    /* like clear, but the chunks are kept and handed out again, so that
+     * an arena which gets filled and reset over and over stops allocating
+     */
+    void reset();
+
+    stats get_stats() const {
+        return stats{p_used, p_size, p_nchunks};
+    }
+
+private:
+    struct chunk {
+        chunk *next;
+        std::size_t size;
+    };
+
+    struct dtor {
+        void (*func)(void *);
+        void *ptr;
+        dtor *next;
+    };
+
+    void add_dtor(void *ptr, void (*func)(void *));
+
+    chunk *p_chunks = nullptr;
+    chunk *p_free = nullptr; /* kept by reset, not in use */
+    dtor *p_dtors = nullptr;
+    char *p_cur = nullptr;
+    char *p_end = nullptr;
+    std::size_t p_used = 0;
+    std::size_t p_size = 0;
+    std::size_t p_nchunks = 0;
+};
+
+} /* namespace util */
+
+#endif /* ARENA_HH */
@@ -4,6 +4,7 @@
 #include <climits>
 #include <ctime>
 #include <type_traits>
+#include <algorithm>
 
 #include "platform.hh"
 #include "ast.hh"
@@ -539,7 +540,7 @@ c_value c_expr::eval(c_expr_type &et, bool promote) const {
 void c_param::do_serialize(std::string &o, c_object_cont_f, void *) const {
     p_type.do_serialize(o, [](std::string &out, void *data) {
         auto &p = *static_cast<c_param const *>(data);
-        if (!p.p_name.empty()) {
+        if (*p.p_name) {
             if (out.back() != '*') {
                 out += ' ';
             }
@@ -825,6 +826,10 @@ size_t c_type::alloc_size() const {
 bool c_type::is_same(
     c_type const &other, bool ignore_cv, bool ignore_ref
 ) const {
+    /* interned types of cdata are commonly the very same object */
+    if (this == &other) {
+        return true;
+    }
     if (!ignore_cv && (cv() != other.cv())) {
         return false;
     }
@@ -908,7 +913,7 @@ bool c_function::is_same(c_function const &other) const {
     if (!p_result.is_same(other.p_result)) {
         return false;
     }
-    if (p_variadic != other.p_variadic) {
+    if (variadic() != other.variadic()) {
         return false;
     }
     if (p_params.size() != other.p_params.size()) {
@@ -922,23 +927,91 @@ bool c_function::is_same(c_function const &other) const {
     return true;
 }
 
+bool c_type::is_identical(c_type const &other) const {
+    if (this == &other) {
+        return true;
+    }
+    /* weak and owned types are interchangeable */
+    if (
+        (type() != other.type()) || (cv() != other.cv()) ||
+        ((p_flags | C_TYPE_WEAK) != (other.p_flags | C_TYPE_WEAK)) ||
+        (p_asize != other.p_asize)
+    ) {
+        return false;
+    }
+    switch (type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY:
+            return p_cptr->is_identical(*other.p_cptr);
+        case C_BUILTIN_FUNC: {
+            auto &f1 = *p_cfptr;
+            auto &f2 = *other.p_cfptr;
+            if (&f1 == &f2) {
+                return true;
+            }
+            if (
+                (f1.variadic() != f2.variadic()) ||
+                (f1.callconv() != f2.callconv()) ||
+                (f1.params().size() != f2.params().size()) ||
+                !f1.result().is_identical(f2.result())
+            ) {
+                return false;
+            }
+            for (size_t i = 0; i < f1.params().size(); ++i) {
+                auto &p1 = f1.params()[i].type();
+                if (!p1.is_identical(f2.params()[i].type())) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case C_BUILTIN_RECORD:
+            return p_crec == other.p_crec;
+        case C_BUILTIN_ENUM:
+            return p_cenum == other.p_cenum;
+        default:
+            break;
+    }
+    return true;
+}
+
+size_t c_type::hash() const {
+    size_t h = (size_t(p_ttype) << 7) | (size_t(p_flags | C_TYPE_WEAK) << 2);
+    h |= size_t(p_cv);
+    h ^= p_asize * 31;
+    switch (type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY:
+            return h ^ (p_cptr->hash() * 131);
+        case C_BUILTIN_FUNC: {
+            auto &f = *p_cfptr;
+            h ^= (f.result().hash() * 131) ^ f.params().size();
+            for (auto &p: f.params()) {
+                h = (h * 31) ^ p.type().hash();
+            }
+            return h;
+        }
+        case C_BUILTIN_RECORD:
+            return h ^ std::hash<void const *>{}(p_crec);
+        case C_BUILTIN_ENUM:
+            return h ^ std::hash<void const *>{}(p_cenum);
+        default:
+            break;
+    }
+    return h;
+}
+
 bool c_record::is_same(c_record const &other) const {
     return &other == this;
 }
 
 ptrdiff_t c_record::field_offset(char const *fname, c_type const *&fld) const {
-    ptrdiff_t ret = -1;
-    iter_fields([fname, &ret, &fld](
-        char const *ffname, ast::c_type const &ffld, size_t off
-    ) {
-        if (!strcmp(fname, ffname)) {
-            ret = ptrdiff_t(off);
-            fld = &ffld;
-            return true;
-        }
-        return false;
-    });
-    return ret;
+    auto it = p_findex.find(fname);
+    if (it == p_findex.end()) {
+        return -1;
+    }
+    fld = it->second.second;
+    return ptrdiff_t(it->second.first);
 }
 
 size_t c_record::iter_fields(bool (*cb)(
@@ -956,7 +1029,7 @@ size_t c_record::iter_fields(bool (*cb)(
         auto *tp = p_elements[i];
         size_t align = tp->alignment;
         base = ((base + align - 1) / align) * align;
-        if (p_fields[i].name.empty()) {
+        if (!*p_fields[i].name) {
             /* transparent record is like a real member */
             assert(p_fields[i].type.type() == ast::C_BUILTIN_RECORD);
             p_fields[i].type.record().iter_fields(cb, data, base, end);
@@ -964,9 +1037,7 @@ size_t c_record::iter_fields(bool (*cb)(
                 return base;
             }
         } else {
-            end = cb(
-                p_fields[i].name.c_str(), p_fields[i].type, obase + base, data
-            );
+            end = cb(p_fields[i].name, p_fields[i].type, obase + base, data);
             if (end) {
                 return base;
             }
@@ -978,8 +1049,7 @@ size_t c_record::iter_fields(bool (*cb)(
     if (flex) {
         base = p_ffi_type.size;
         end = cb(
-            p_fields.back().name.c_str(), p_fields.back().type,
-            obase + base, data
+            p_fields.back().name, p_fields.back().type, obase + base, data
         );
     }
     return base;
@@ -990,7 +1060,21 @@ void c_record::set_fields(std::vector<field> fields) {
     assert(!p_elements);
 
     p_fields = std::move(fields);
+    set_layout();
+
+    /* flatten the fields (including those of transparent members) into
+     * a lookup table so that field access does not have to walk them all;
+     * the keys point into the field names, which are never modified again
+     *
+     * in case of duplicates the first one wins, same as with iteration
+     */
+    iter_fields([this](char const *fname, c_type const &type, size_t off) {
+        p_findex.emplace(fname, std::make_pair(off, &type));
+        return false;
+    });
+}
 
+void c_record::set_layout() {
     /* when dealing with flexible array members, we will need to pad the
      * struct to satisfy alignment of the flexible member, and use that
      * as the last member of the struct
@@ -1100,70 +1184,677 @@ void c_record::set_fields(std::vector<field> fields) {
 /* decl store implementation, with overlaying for staging */
 
 void decl_store::add(c_object *decl) {
-    if (lookup(decl->name())) {
+    /* names always come interned, no need to go through find_name */
+    if (lookup_interned(decl->name())) {
         auto ot = decl->obj_type();
         if (
             (ot != ast::c_object_type::VARIABLE) &&
             (ot != ast::c_object_type::TYPEDEF)
         ) {
             redefine_error rd{decl->name()};
-            delete decl;
+            decl->~c_object();
             throw rd;
         } else {
             /* redefinitions of vars and funcs are okay
              * luajit doesn't check them so we don't either
              */
-            delete decl;
+            decl->~c_object();
             return;
         }
     }
 
-    p_dlist.emplace_back(decl);
-    auto &d = *p_dlist.back();
-    p_dmap.emplace(d.name(), &d);
+    p_dlist.push_back(decl);
+    p_dmap.emplace(decl->name(), decl);
 }
 
 void decl_store::commit() {
     /* this should only ever be used when staging */
     assert(p_base);
-    /* reserve all space at once */
-    p_base->p_dlist.reserve(p_base->p_dlist.size() + p_dlist.size());
-    /* move all */
-    for (auto &u: p_dlist) {
-        p_base->p_dlist.push_back(std::move(u));
+    /* reserve all space at once, but keep the growth geometric; the base
+     * may see many small commits and reserving just what is needed would
+     * reallocate every single time
+     */
+    auto nlist = p_base->p_dlist.size() + p_dlist.size();
+    if (nlist > p_base->p_dlist.capacity()) {
+        p_base->p_dlist.reserve(std::max(nlist, p_base->p_dlist.size() * 2));
+    }
+    auto nmap = p_base->p_dmap.size() + p_dmap.size();
+    if (nmap > p_base->p_dmap.bucket_count()) {
+        p_base->p_dmap.reserve(std::max(nmap, p_base->p_dmap.size() * 2));
     }
+    /* move all */
+    p_base->p_dlist.insert(
+        p_base->p_dlist.end(), p_dlist.begin(), p_dlist.end()
+    );
     /* set up mappings in base */
     for (auto const &p: p_dmap) {
         p_base->p_dmap.emplace(p);
     }
+    if (!p_dlist.empty()) {
+        ++p_base->p_gen;
+    }
+    /* the base owns them now */
+    p_dlist.clear();
     drop();
 }
 
 void decl_store::drop() {
     p_dmap.clear();
+    /* the memory belongs to the arena of the main store */
+    for (auto *d: p_dlist) {
+        d->~c_object();
+    }
     p_dlist.clear();
 }
 
-c_object const *decl_store::lookup(char const *name) const {
-    auto it = p_dmap.find(name);
-    if (it != p_dmap.cend()) {
-        return it->second;
-    }
-    if (p_base) {
-        return p_base->lookup(name);
+c_object *decl_store::lookup_interned(char const *name) const {
+    for (auto *ds = this; ds; ds = ds->p_base) {
+        auto it = ds->p_dmap.find(name);
+        if (it != ds->p_dmap.cend()) {
+            return it->second;
+        }
     }
     return nullptr;
 }
 
+c_object const *decl_store::lookup(char const *name) const {
+    auto *iname = find_name(name);
+    if (!iname) {
+        return nullptr;
+    }
+    return lookup_interned(iname);
+}
+
 c_object *decl_store::lookup(char const *name) {
-    auto it = p_dmap.find(name);
-    if (it != p_dmap.end()) {
-        return it->second;
+    auto *iname = find_name(name);
+    if (!iname) {
+        return nullptr;
     }
-    if (p_base) {
-        return p_base->lookup(name);
+    return lookup_interned(iname);
+}
+
+char const *decl_store::intern_name(std::string const &name) {
+    auto &rs = root();
+    auto it = rs.p_names.find(name.c_str());
+    if (it != rs.p_names.end()) {
+        return *it;
+    }
+    auto len = name.size() + 1;
+    auto *ret = static_cast<char *>(rs.p_arena.alloc(len, 1));
+    memcpy(ret, name.c_str(), len);
+    rs.p_names.insert(ret);
+    rs.p_name_bytes += len;
+    return ret;
+}
+
+char const *decl_store::find_name(char const *name) const {
+    auto &rs = root();
+    auto it = rs.p_names.find(name);
+    if (it == rs.p_names.end()) {
+        return nullptr;
+    }
+    return *it;
+}
+
+void decl_store::lazy_source(std::unique_ptr<char[]> src, std::size_t len) {
+    p_lazy_src.push_back(std::move(src));
+    p_lazy_size += len;
+}
+
+void decl_store::lazy_add(
+    lazy_decl const &decl, std::vector<std::string> &names
+) {
+    auto id = p_lazy.size();
+    p_lazy.push_back(decl);
+    p_lazy.back().done = false;
+    for (auto &nm: names) {
+        p_lazy_names.emplace(std::move(nm), id);
+    }
+    ++p_lazy_pending;
+}
+
+bool decl_store::lazy_take(char const *name, std::vector<std::size_t> &out) {
+    if (!p_lazy_pending) {
+        return false;
+    }
+    auto rng = p_lazy_names.equal_range(name);
+    auto osz = out.size();
+    for (auto it = rng.first; it != rng.second; ++it) {
+        auto &d = p_lazy[it->second];
+        if (!d.done) {
+            d.done = true;
+            --p_lazy_pending;
+            out.push_back(it->second);
+        }
+    }
+    if (out.size() == osz) {
+        return false;
+    }
+    std::sort(out.begin() + osz, out.end());
+    return true;
+}
+
+bool decl_store::lazy_take_all(std::vector<std::size_t> &out) {
+    if (!p_lazy_pending) {
+        return false;
+    }
+    for (std::size_t i = 0; i < p_lazy.size(); ++i) {
+        if (!p_lazy[i].done) {
+            p_lazy[i].done = true;
+            out.push_back(i);
+        }
+    }
+    p_lazy_pending = 0;
+    return true;
+}
+
+void decl_store::lazy_restore(std::vector<std::size_t> const &ids) {
+    for (auto id: ids) {
+        if (p_lazy[id].done) {
+            p_lazy[id].done = false;
+            ++p_lazy_pending;
+        }
+    }
+}
+
+c_type const &decl_store::intern(c_type const &tp) {
+    auto h = tp.hash();
+    auto rng = p_types.equal_range(h);
+    for (auto it = rng.first; it != rng.second; ++it) {
+        if (it->second->is_identical(tp)) {
+            return *it->second;
+        }
+    }
+    /* interned types are laid out in the arena, and the parts of them
+     * that would otherwise be owned copies are interned too and shared
+     */
+    c_type *ret;
+    switch (tp.type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY: {
+            auto &base = intern(tp.ptr_base());
+            ret = p_arena.make<c_type>(&base, uint32_t(tp.cv()), tp.type());
+            break;
+        }
+        case C_BUILTIN_FUNC: {
+            auto &ofunc = *tp.p_cfptr;
+            std::vector<c_param> params;
+            params.reserve(ofunc.params().size());
+            for (auto &p: ofunc.params()) {
+                params.emplace_back(p.name(), intern(p.type()));
+            }
+            auto *func = p_arena.make<c_function>(
+                intern(ofunc.result()), std::move(params), ofunc.flags()
+            );
+            ret = p_arena.make<c_type>(
+                static_cast<c_function const *>(func), uint32_t(tp.cv())
+            );
+            break;
+        }
+        default:
+            ret = p_arena.make<c_type>(tp);
+            break;
+    }
+    ret->p_asize = tp.p_asize;
+    ret->p_flags = tp.p_flags | C_TYPE_WEAK;
+    ret->p_intern = true;
+    p_types.emplace(h, ret);
+    return *ret;
+}
+
+decl_store::stats decl_store::get_stats() const {
+    return stats{
+        p_dlist.size(), p_decl_bytes, p_names.size(), p_name_bytes,
+        p_types.size(), p_lazy_pending, p_lazy_size, p_arena.get_stats()
+    };
+}
+
+/* binary declaration images
+ *
+ * everything is stored in native byte order and sizes, the header records
+ * enough about the platform to refuse images made elsewhere; the layout is
+ *
+ * header, object count, objects (records and enums without their members),
+ * then the members of all records and enums that have them, in the same
+ * order as the objects; records and enums are referred to by their index,
+ * so when reading the objects, they all exist by the time the members are
+ * read, which allows any references between them
+ */
+
+static constexpr char IMAGE_MAGIC[8] = {
+    '\x1B', 'c', 'f', 'f', 'i', 'd', 's', '\0'
+};
+static constexpr uint32_t IMAGE_VERSION = 1;
+
+struct image_header {
+    char magic[sizeof(IMAGE_MAGIC)];
+    uint32_t version;
+    unsigned char sizes[4];
+    unsigned char big_endian;
+    unsigned char arch;
+    unsigned char os;
+    unsigned char pad;
+
+    void init() {
+        memset(this, 0, sizeof(*this));
+        memcpy(magic, IMAGE_MAGIC, sizeof(magic));
+        version = IMAGE_VERSION;
+        sizes[0] = sizeof(void *);
+        sizes[1] = sizeof(long);
+        sizes[2] = sizeof(long double);
+        sizes[3] = sizeof(c_value);
+#ifdef FFI_BIG_ENDIAN
+        big_endian = 1;
+#endif
+        arch = FFI_ARCH;
+        os = FFI_OS;
+    }
+};
+
+struct image_writer {
+    std::string &out;
+    std::unordered_map<c_object const *, uint32_t> idx{};
+
+    void put(void const *p, std::size_t n) {
+        out.append(static_cast<char const *>(p), n);
+    }
+
+    template<typename T>
+    void put(T v) {
+        put(&v, sizeof(v));
+    }
+
+    void put_str(char const *str) {
+        auto n = uint32_t(strlen(str));
+        put(n);
+        put(str, n);
+    }
+
+    void put_ref(c_object const *obj) {
+        auto it = idx.find(obj);
+        if (it == idx.end()) {
+            throw image_error{
+                "reference to a declaration outside of the store"
+            };
+        }
+        put(it->second);
+    }
+
+    void put_type(c_type const &tp);
+    void put_func(c_function const &func);
+};
+
+void image_writer::put_func(c_function const &func) {
+    put_type(func.result());
+    uint32_t flags = func.callconv();
+    if (func.variadic()) {
+        flags |= C_FUNC_VARIADIC;
+    }
+    put(flags);
+    put(uint32_t(func.params().size()));
+    for (auto &par: func.params()) {
+        put_str(par.name());
+        put_type(par.type());
+    }
+}
+
+void image_writer::put_type(c_type const &tp) {
+    put(uint8_t(tp.type()));
+    put(uint8_t(tp.p_flags & ~C_TYPE_WEAK));
+    put(uint8_t(tp.cv()));
+    switch (tp.type()) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY:
+            if (!tp.owns()) {
+                throw image_error{"unsupported type reference"};
+            }
+            put(uint64_t(tp.p_asize));
+            put_type(*tp.p_ptr);
+            break;
+        case C_BUILTIN_FUNC:
+            if (!tp.owns()) {
+                throw image_error{"unsupported function reference"};
+            }
+            put_func(*tp.p_fptr);
+            break;
+        case C_BUILTIN_RECORD:
+            put_ref(tp.p_crec);
+            break;
+        case C_BUILTIN_ENUM:
+            put_ref(tp.p_cenum);
+            break;
+        default:
+            break;
+    }
+}
+
+void decl_store::save(std::string &out) const {
+    image_header hdr;
+    hdr.init();
+    image_writer w{out};
+    w.put(hdr);
+    w.put(uint32_t(p_dlist.size()));
+    for (auto &d: p_dlist) {
+        auto idx = uint32_t(w.idx.size());
+        w.idx.emplace(d, idx);
+    }
+    for (auto &d: p_dlist) {
+        auto ot = d->obj_type();
+        w.put(uint8_t(ot));
+        w.put_str(d->name());
+        switch (ot) {
+            case c_object_type::TYPEDEF:
+                w.put_type(d->as<c_typedef>().type());
+                break;
+            case c_object_type::VARIABLE: {
+                auto &var = d->as<c_variable>();
+                w.put_str((var.sym() == var.name()) ? "" : var.sym());
+                w.put_type(var.type());
+                break;
+            }
+            case c_object_type::CONSTANT: {
+                auto &cst = d->as<c_constant>();
+                w.put_type(cst.type());
+                w.put(cst.value());
+                break;
+            }
+            case c_object_type::RECORD: {
+                auto &rec = d->as<c_record>();
+                w.put(uint8_t(rec.is_union()));
+                w.put(uint8_t(!rec.opaque()));
+                break;
+            }
+            case c_object_type::ENUM:
+                w.put(uint8_t(!d->as<c_enum>().opaque()));
+                break;
+            default:
+                throw image_error{"unsupported declaration"};
+        }
+    }
+    /* members go last */
+    for (auto &d: p_dlist) {
+        auto ot = d->obj_type();
+        if (ot == c_object_type::RECORD) {
+            auto &rec = d->as<c_record>();
+            if (rec.opaque()) {
+                continue;
+            }
+            w.put(uint32_t(rec.fields().size()));
+            for (auto &fld: rec.fields()) {
+                w.put_str(fld.name);
+                w.put_type(fld.type);
+            }
+        } else if (ot == c_object_type::ENUM) {
+            auto &en = d->as<c_enum>();
+            if (en.opaque()) {
+                continue;
+            }
+            w.put(uint32_t(en.fields().size()));
+            for (auto &fld: en.fields()) {
+                w.put_str(fld.name);
+                w.put(int32_t(fld.value));
+            }
+        }
+    }
+}
+
+struct image_reader {
+    decl_store &ds;
+    char const *p;
+    char const *end;
+    /* records and enums by index, null for anything else */
+    std::vector<c_object *> objs{};
+
+    void get(void *v, std::size_t n) {
+        if (std::size_t(end - p) < n) {
+            throw image_error{"truncated image"};
+        }
+        memcpy(v, p, n);
+        p += n;
+    }
+
+    template<typename T>
+    T get() {
+        T v;
+        get(&v, sizeof(v));
+        return v;
+    }
+
+    std::string get_str() {
+        auto n = get<uint32_t>();
+        if (std::size_t(end - p) < n) {
+            throw image_error{"truncated image"};
+        }
+        std::string ret{p, n};
+        p += n;
+        return ret;
+    }
+
+    char const *get_name() {
+        return ds.intern_name(get_str());
+    }
+
+    c_object *get_ref(c_object_type ot) {
+        auto i = get<uint32_t>();
+        if ((i >= objs.size()) || !objs[i] || (objs[i]->obj_type() != ot)) {
+            throw image_error{"invalid declaration reference"};
+        }
+        return objs[i];
+    }
+
+    c_type get_type(std::size_t depth = 0);
+    c_function get_func(std::size_t depth);
+};
+
+/* nothing sensible nests this deep, so this only guards against garbage */
+static constexpr std::size_t IMAGE_MAX_DEPTH = 256;
+
+c_function image_reader::get_func(std::size_t depth) {
+    auto res = get_type(depth + 1);
+    auto flags = get<uint32_t>();
+    auto n = get<uint32_t>();
+    std::vector<c_param> params;
+    for (uint32_t i = 0; i < n; ++i) {
+        auto *pname = get_name();
+        params.emplace_back(pname, get_type(depth + 1));
+    }
+    return c_function{std::move(res), std::move(params), flags};
+}
+
+c_type image_reader::get_type(std::size_t depth) {
+    if (depth > IMAGE_MAX_DEPTH) {
+        throw image_error{"type nested too deep"};
+    }
+    auto tt = get<uint8_t>();
+    auto flags = get<uint8_t>();
+    auto cv = get<uint8_t>();
+    if (
+        (tt == C_BUILTIN_INVALID) || (tt > C_BUILTIN_LDOUBLE) ||
+        (flags & C_TYPE_WEAK) || (cv > (C_CV_CONST | C_CV_VOLATILE))
+    ) {
+        throw image_error{"invalid type"};
+    }
+    c_type ret{C_BUILTIN_INVALID, 0};
+    switch (tt) {
+        case C_BUILTIN_PTR:
+        case C_BUILTIN_ARRAY: {
+            auto asize = get<uint64_t>();
+            ret = c_type{get_type(depth + 1), cv, c_builtin(tt)};
+            ret.p_asize = std::size_t(asize);
+            break;
+        }
+        case C_BUILTIN_FUNC:
+            ret = c_type{get_func(depth), cv};
+            break;
+        case C_BUILTIN_RECORD:
+            ret = c_type{
+                &get_ref(c_object_type::RECORD)->as<c_record>(), cv
+            };
+            break;
+        case C_BUILTIN_ENUM:
+            ret = c_type{&get_ref(c_object_type::ENUM)->as<c_enum>(), cv};
+            break;
+        default:
+            ret = c_type{c_builtin(tt), cv};
+            break;
+    }
+    ret.p_flags |= flags;
+    return ret;
+}
+
+/* whether the record or enum got a generated name in the parser */
+static bool image_anon_name(std::string const &name) {
+    auto sp = name.find(' ');
+    if ((sp == std::string::npos) || (sp + 1 == name.size())) {
+        return false;
+    }
+    for (auto i = sp + 1; i < name.size(); ++i) {
+        if ((name[i] < '0') || (name[i] > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* lays out the record after everything it contains by value */
+static void image_complete(
+    std::unordered_map<c_object *, std::vector<c_record::field>> &rdefs,
+    c_object *obj
+) {
+    auto it = rdefs.find(obj);
+    if (it == rdefs.end()) {
+        return;
+    }
+    auto fields = std::move(it->second);
+    rdefs.erase(it);
+    for (auto &fld: fields) {
+        c_type const *tp = &fld.type;
+        while (tp->type() == C_BUILTIN_ARRAY) {
+            tp = &tp->ptr_base();
+        }
+        if (tp->type() == C_BUILTIN_RECORD) {
+            image_complete(rdefs, const_cast<c_record *>(&tp->record()));
+        }
+    }
+    obj->as<c_record>().set_fields(std::move(fields));
+}
+
+void decl_store::load(char const *buf, std::size_t len) {
+    image_reader r{*this, buf, buf + len};
+    image_header hdr, ref;
+    ref.init();
+    r.get(&hdr, sizeof(hdr));
+    if (memcmp(hdr.magic, ref.magic, sizeof(hdr.magic))) {
+        throw image_error{"not a declaration image"};
+    }
+    if (hdr.version != ref.version) {
+        throw image_error{"unsupported image version"};
+    }
+    if (memcmp(&hdr, &ref, sizeof(hdr))) {
+        throw image_error{"image made for a different platform"};
+    }
+    auto nobjs = r.get<uint32_t>();
+    p_dlist.reserve(p_dlist.size() + nobjs);
+    p_dmap.reserve(p_dmap.size() + nobjs);
+    /* members are filled in later, remember which objects get them */
+    std::vector<c_object *> defs;
+    for (uint32_t i = 0; i < nobjs; ++i) {
+        auto ot = c_object_type(r.get<uint8_t>());
+        auto name = r.get_str();
+        c_object *obj = nullptr;
+        c_object *def = nullptr;
+        switch (ot) {
+            case c_object_type::TYPEDEF: {
+                auto tp = r.get_type();
+                /* declaring these again does nothing, skip making them */
+                auto *iname = intern_name(name);
+                if (!lookup_interned(iname)) {
+                    add(make<c_typedef>(iname, std::move(tp)));
+                }
+                break;
+            }
+            case c_object_type::VARIABLE: {
+                auto *sym = r.get_name();
+                auto tp = r.get_type();
+                auto *iname = intern_name(name);
+                if (!lookup_interned(iname)) {
+                    add(make<c_variable>(iname, sym, std::move(tp)));
+                }
+                break;
+            }
+            case c_object_type::CONSTANT: {
+                auto tp = r.get_type();
+                auto val = r.get<c_value>();
+                add(make<c_constant>(intern_name(name), std::move(tp), val));
+                break;
+            }
+            case c_object_type::RECORD:
+            case c_object_type::ENUM: {
+                bool uni = false;
+                if (ot == c_object_type::RECORD) {
+                    uni = !!r.get<uint8_t>();
+                }
+                bool defd = !!r.get<uint8_t>();
+                if (image_anon_name(name)) {
+                    name.erase(name.find(' ') + 1);
+                    name += request_name();
+                }
+                /* like the parser, complete previous opaque declarations */
+                obj = lookup(name.c_str());
+                if (obj && (obj->obj_type() == ot)) {
+                    bool opq = (ot == c_object_type::RECORD)
+                        ? obj->as<c_record>().opaque()
+                        : obj->as<c_enum>().opaque();
+                    if (defd && !opq) {
+                        throw redefine_error{name};
+                    }
+                } else if (ot == c_object_type::RECORD) {
+                    obj = make<c_record>(intern_name(name), uni);
+                    add(obj);
+                } else {
+                    obj = make<c_enum>(intern_name(name));
+                    add(obj);
+                }
+                if (defd) {
+                    def = obj;
+                }
+                break;
+            }
+            default:
+                throw image_error{"invalid declaration"};
+        }
+        r.objs.push_back(obj);
+        if (def) {
+            defs.push_back(def);
+        }
+    }
+    /* records may be completed in a different order than they were first
+     * declared in, so the members of all are read before laying any out
+     */
+    std::unordered_map<c_object *, std::vector<c_record::field>> rdefs;
+    for (auto *obj: defs) {
+        auto n = r.get<uint32_t>();
+        if (obj->obj_type() == c_object_type::RECORD) {
+            auto &fields = rdefs[obj];
+            for (uint32_t i = 0; i < n; ++i) {
+                auto *fname = r.get_name();
+                fields.emplace_back(fname, r.get_type());
+            }
+        } else {
+            std::vector<c_enum::field> fields;
+            for (uint32_t i = 0; i < n; ++i) {
+                auto *fname = r.get_name();
+                fields.emplace_back(fname, r.get<int32_t>());
+            }
+            obj->as<c_enum>().set_fields(std::move(fields));
+        }
+    }
+    if (r.p != r.end) {
+        throw image_error{"trailing data in image"};
+    }
+    for (auto *obj: defs) {
+        image_complete(rdefs, obj);
     }
-    return nullptr;
 }
 
 std::string decl_store::request_name() const {
@@ -1212,7 +1903,7 @@ c_type from_lua_type(lua_State *L, int index) {
             if (!cd) {
                 return c_type{c_type{C_BUILTIN_VOID, 0}, 0};
             }
-            return cd->decl;
+            return *cd->decl;
         }
         default:
             break;
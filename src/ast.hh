@@ -3,18 +3,22 @@
 
 #include <cstring>
 #include <cstddef>
+#include <cstdint>
 #include <cassert>
 #include <ctime>
 
 #include "lua.hh"
 #include "libffi.hh"
+#include "arena.hh"
 
 #include <type_traits>
 #include <limits>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
+#include <utility>
 #include <stdexcept>
 
 namespace ast {
@@ -477,6 +481,9 @@ struct c_object {
     c_object() {}
     virtual ~c_object() {}
 
+    /* names are interned in the main declaration store, so they live as
+     * long as it does and the same name is always the same pointer
+     */
     virtual char const *name() const = 0;
     virtual c_object_type obj_type() const = 0;
     virtual void do_serialize(
@@ -712,6 +719,15 @@ struct c_type: c_object {
         c_type const &other, bool ignore_cv = false, bool ignore_ref = false
     ) const;
 
+    /* exact identity including qualifiers and flags, for interning */
+    bool is_identical(c_type const &other) const;
+    size_t hash() const;
+
+    /* whether this is the canonical copy held by the declaration store */
+    bool interned() const {
+        return p_intern;
+    }
+
     /* only use this with ref and ptr types */
     c_type as_type(int cbt) const {
         auto ret = c_type{*this};
@@ -721,6 +737,10 @@ struct c_type: c_object {
     }
 
 private:
+    friend struct decl_store;
+    friend struct image_reader;
+    friend struct image_writer;
+
     void clear();
     void copy(c_type const &);
 
@@ -737,11 +757,12 @@ private:
     uint32_t p_ttype: 5;
     uint32_t p_flags: 5;
     uint32_t p_cv: 2;
+    bool p_intern = false;
 };
 
 struct c_param: c_object {
-    c_param(std::string pname, c_type type):
-        p_name{std::move(pname)}, p_type{std::move(type)}
+    c_param(char const *pname, c_type type):
+        p_name{pname}, p_type{std::move(type)}
     {}
 
     c_object_type obj_type() const {
@@ -751,7 +772,7 @@ struct c_param: c_object {
     void do_serialize(std::string &o, c_object_cont_f cont, void *data) const;
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     c_type const &type() const {
@@ -767,7 +788,7 @@ struct c_param: c_object {
     }
 
 private:
-    std::string p_name;
+    char const *p_name;
     c_type p_type;
 };
 
@@ -818,17 +839,19 @@ struct c_function: c_object {
         p_flags |= conv & 0xFF;
     }
 
+    uint32_t flags() const {
+        return p_flags;
+    }
+
 private:
     c_type p_result;
     std::vector<c_param> p_params;
     uint32_t p_flags;
-    bool p_variadic;
 };
 
 struct c_variable: c_object {
-    c_variable(std::string vname, std::string sym, c_type vtype):
-        p_name{std::move(vname)}, p_sname{std::move(sym)},
-        p_type{std::move(vtype)}
+    c_variable(char const *vname, char const *sym, c_type vtype):
+        p_name{vname}, p_sname{sym}, p_type{std::move(vtype)}
     {}
 
     c_object_type obj_type() const {
@@ -840,14 +863,14 @@ struct c_variable: c_object {
     }
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     char const *sym() const {
-        if (!p_sname.empty()) {
-            return p_sname.c_str();
+        if (*p_sname) {
+            return p_sname;
         }
-        return p_name.c_str();
+        return p_name;
     }
 
     c_type const &type() const {
@@ -863,14 +886,14 @@ struct c_variable: c_object {
     }
 
 private:
-    std::string p_name;
-    std::string p_sname;
+    char const *p_name;
+    char const *p_sname;
     c_type p_type;
 };
 
 struct c_constant: c_object {
-    c_constant(std::string cname, c_type ctype, c_value const &cval):
-        p_name{std::move(cname)}, p_type{std::move(ctype)}, p_value{cval}
+    c_constant(char const *cname, c_type ctype, c_value const &cval):
+        p_name{cname}, p_type{std::move(ctype)}, p_value{cval}
     {}
 
     c_object_type obj_type() const {
@@ -882,7 +905,7 @@ struct c_constant: c_object {
     }
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     c_type const &type() const {
@@ -902,14 +925,14 @@ struct c_constant: c_object {
     }
 
 private:
-    std::string p_name;
+    char const *p_name;
     c_type p_type;
     c_value p_value;
 };
 
 struct c_typedef: c_object {
-    c_typedef(std::string aname, c_type btype):
-        p_name{std::move(aname)}, p_type{std::move(btype)}
+    c_typedef(char const *aname, c_type btype):
+        p_name{aname}, p_type{std::move(btype)}
     {}
 
     c_object_type obj_type() const {
@@ -922,7 +945,7 @@ struct c_typedef: c_object {
     }
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     c_type const &type() const {
@@ -938,29 +961,29 @@ struct c_typedef: c_object {
     }
 
 private:
-    std::string p_name;
+    char const *p_name;
     c_type p_type;
 };
 
 /* represents a record type: can be a struct or a union */
 struct c_record: c_object {
     struct field {
-        field(std::string nm, c_type &&tp):
-            name{std::move(nm)}, type(std::move(tp))
+        field(char const *nm, c_type &&tp):
+            name{nm}, type(std::move(tp))
         {}
 
-        std::string name;
+        char const *name;
         c_type type;
     };
 
-    c_record(std::string ename, std::vector<field> fields, bool is_uni = false):
-        p_name{std::move(ename)}, p_uni{is_uni}
+    c_record(char const *ename, std::vector<field> fields, bool is_uni = false):
+        p_name{ename}, p_uni{is_uni}
     {
         set_fields(std::move(fields));
     }
 
-    c_record(std::string ename, bool is_uni = false):
-        p_name{std::move(ename)}, p_uni{is_uni}
+    c_record(char const *ename, bool is_uni = false):
+        p_name{ename}, p_uni{is_uni}
     {}
 
     c_object_type obj_type() const {
@@ -975,7 +998,7 @@ struct c_record: c_object {
     }
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     /* invalid for opaque structs */
@@ -1028,12 +1051,21 @@ struct c_record: c_object {
         return p_uni;
     }
 
+    /* the direct members, with anonymous ones not flattened */
+    std::vector<field> const &fields() const {
+        return p_fields;
+    }
+
     /* it is the responsibility of the caller to ensure we're not redefining */
     void set_fields(std::vector<field> fields);
 
-    void metatype(int mt, int mf) {
+    /* the handlers are registry references to the metamethods, indexed
+     * by the flag bit; they get resolved once, when the metatype is set
+     */
+    void metatype(int mt, int mf, std::unique_ptr<int[]> handlers) {
         p_metatype = mt;
         p_metaflags = mf;
+        p_metahandlers = std::move(handlers);
     }
 
     int metatype(int &flags) const {
@@ -1041,6 +1073,15 @@ struct c_record: c_object {
         return p_metatype;
     }
 
+    int metaflags() const {
+        return p_metaflags;
+    }
+
+    /* only valid when the flag is set */
+    int metahandler(int idx) const {
+        return p_metahandlers[idx];
+    }
+
     template<typename F>
     void iter_fields(F &&cb) const {
         bool end = false;
@@ -1057,12 +1098,19 @@ private:
         char const *fname, c_type const &type, size_t off, void *data
     ), void *data, size_t base, bool &end) const;
 
-    std::string p_name;
+    void set_layout();
+
+    char const *p_name;
     std::vector<field> p_fields{};
+    std::unordered_map<
+        char const *, std::pair<size_t, c_type const *>,
+        util::str_hash, util::str_equal
+    > p_findex{};
     std::unique_ptr<ffi_type *[]> p_elements{};
     std::unique_ptr<ffi_type *[]> p_felems{};
     ffi_type p_ffi_type{};
     ffi_type p_ffi_flex{};
+    std::unique_ptr<int[]> p_metahandlers{};
     int p_metatype = LUA_REFNIL;
     int p_metaflags = 0;
     bool p_uni;
@@ -1070,21 +1118,21 @@ private:
 
 struct c_enum: c_object {
     struct field {
-        field(std::string nm, int val):
-            name{std::move(nm)}, value(val)
+        field(char const *nm, int val):
+            name{nm}, value(val)
         {}
 
-        std::string name;
+        char const *name;
         int value; /* FIXME: make a c_expr */
     };
 
-    c_enum(std::string ename, std::vector<field> fields):
-        p_name{std::move(ename)}
+    c_enum(char const *ename, std::vector<field> fields):
+        p_name{ename}
     {
         set_fields(std::move(fields));
     }
 
-    c_enum(std::string ename): p_name{std::move(ename)} {}
+    c_enum(char const *ename): p_name{ename} {}
 
     c_object_type obj_type() const {
         return c_object_type::ENUM;
@@ -1098,7 +1146,7 @@ struct c_enum: c_object {
     }
 
     char const *name() const {
-        return p_name.c_str();
+        return p_name;
     }
 
     std::vector<field> const &fields() const {
@@ -1128,7 +1176,7 @@ struct c_enum: c_object {
     }
 
 private:
-    std::string p_name;
+    char const *p_name;
     std::vector<field> p_fields{};
     bool p_opaque = true;
 };
@@ -1137,6 +1185,10 @@ struct redefine_error: public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+struct image_error: public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
 struct decl_store {
     decl_store() {}
     decl_store(decl_store &ds): p_base(&ds) {}
@@ -1146,7 +1198,7 @@ struct decl_store {
 
     decl_store &operator=(decl_store const &) = delete;
 
-    /* takes ownership of the pointer */
+    /* takes ownership of the pointer, which must come from make */
     void add(c_object *decl);
     void commit();
     void drop();
@@ -1154,8 +1206,128 @@ struct decl_store {
     c_object const *lookup(char const *name) const;
     c_object *lookup(char const *name);
 
+    /* for names from intern_name, saves hashing their contents again */
+    c_object *lookup_interned(char const *name) const;
+
     std::string request_name() const;
 
+    /* declarations and the names in them are laid out in the arena of the
+     * main store; staging stores only own the objects until they commit,
+     * dropping destroys them but their memory stays with the main store
+     */
+    template<typename T, typename ...A>
+    T *make(A &&...args) {
+        auto &rs = root();
+        void *mem = rs.p_arena.alloc(sizeof(T), alignof(T));
+        rs.p_decl_bytes += sizeof(T);
+        return new (mem) T(std::forward<A>(args)...);
+    }
+
+    /* the canonical copy of the name, made if there is none yet */
+    char const *intern_name(std::string const &name);
+
+    /* the canonical copy of the name, or null if nothing uses it */
+    char const *find_name(char const *name) const;
+
+    /* writes everything in the store into a compact binary image, which
+     * can be loaded again without parsing; throws image_error when some
+     * declaration cannot be represented
+     */
+    void save(std::string &out) const;
+
+    /* adds the declarations from an image like parsing them would, with
+     * the same redefinition rules; meant for staging, like the parser;
+     * throws image_error for bad or incompatible images
+     */
+    void load(char const *buf, std::size_t len);
+
+    /* declarations from lazy cdef; they are kept as source text and only
+     * get parsed once something looks up one of the names they may declare
+     */
+    struct lazy_decl {
+        char const *beg;
+        char const *end;
+        int line;
+        bool done;
+    };
+
+    /* takes ownership of the source the declarations point into */
+    void lazy_source(std::unique_ptr<char[]> src, std::size_t len);
+    void lazy_add(lazy_decl const &decl, std::vector<std::string> &names);
+
+    /* marks the pending declarations which may define the name as done
+     * and appends their indexes in source order; false if there are none
+     */
+    bool lazy_take(char const *name, std::vector<std::size_t> &out);
+    bool lazy_take_all(std::vector<std::size_t> &out);
+
+    /* puts taken declarations back when their parsing did not go through */
+    void lazy_restore(std::vector<std::size_t> const &ids);
+
+    lazy_decl const &lazy_get(std::size_t id) const {
+        return p_lazy[id];
+    }
+
+    std::size_t lazy_pending() const {
+        return p_lazy_pending;
+    }
+
+    /* get a canonical copy of the given type; cdata and ctypes refer to
+     * these rather than carrying their own, they live as long as the store
+     */
+    c_type const &intern(c_type const &tp);
+
+    static c_type const &intern(lua_State *L, c_type const &tp) {
+        if (tp.interned()) {
+            return tp;
+        }
+        return get_main(L).intern(tp);
+    }
+
+    struct stats {
+        std::size_t decls;
+        std::size_t decl_bytes;
+        std::size_t names;
+        std::size_t name_bytes;
+        std::size_t types;
+        std::size_t lazy_pending;
+        std::size_t lazy_source;
+        util::arena::stats arena;
+    };
+
+    stats get_stats() const;
+
+    /* remembered verdicts of pointer conversion checks between interned
+     * types, for the ones which take more than comparing identities; the
+     * table is small and direct-mapped, so a collision only means having
+     * to do the check again
+     */
+    int conv_get(c_type const *from, c_type const *to) const {
+        if (!p_conv) {
+            return -1;
+        }
+        auto &e = p_conv[conv_slot(from, to)];
+        if ((e.from != from) || (e.to != to)) {
+            return -1;
+        }
+        return e.ok;
+    }
+
+    void conv_set(c_type const *from, c_type const *to, bool ok) {
+        if (!p_conv) {
+            p_conv.reset(new conv_entry[CONV_SLOTS]);
+        }
+        auto &e = p_conv[conv_slot(from, to)];
+        e.from = from;
+        e.to = to;
+        e.ok = ok;
+    }
+
+    /* bumped every time something gets committed into this store */
+    std::size_t generation() const {
+        return p_gen;
+    }
+
     static decl_store &get_main(lua_State *L) {
         lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_DECL_STOR);
         auto *ds = lua::touserdata<decl_store>(L, -1);
@@ -1164,11 +1336,52 @@ struct decl_store {
         return *ds;
     }
 private:
+    static constexpr std::size_t CONV_SLOTS = 64;
+
+    struct conv_entry {
+        c_type const *from = nullptr;
+        c_type const *to = nullptr;
+        bool ok = false;
+    };
+
+    decl_store &root() {
+        decl_store *ds = this;
+        while (ds->p_base) {
+            ds = ds->p_base;
+        }
+        return *ds;
+    }
+
+    decl_store const &root() const {
+        return const_cast<decl_store *>(this)->root();
+    }
+
+    static std::size_t conv_slot(c_type const *from, c_type const *to) {
+        auto h = std::uintptr_t(from) ^ (std::uintptr_t(to) >> 4);
+        return (h ^ (h >> 9)) & (CONV_SLOTS - 1);
+    }
+
+    /* interned types, declarations and names live here; first, so that it
+     * goes away last
+     */
+    util::arena p_arena{};
     decl_store *p_base = nullptr;
-    std::vector<std::unique_ptr<c_object>> p_dlist{};
-    std::unordered_map<
-        char const *, c_object *, util::str_hash, util::str_equal
-    > p_dmap{};
+    std::size_t p_gen = 0;
+    std::vector<c_object *> p_dlist{};
+    /* keyed by the interned name, so lookups compare pointers */
+    std::unordered_map<char const *, c_object *> p_dmap{};
+    std::unordered_set<
+        char const *, util::str_hash, util::str_equal
+    > p_names{};
+    std::size_t p_name_bytes = 0;
+    std::size_t p_decl_bytes = 0;
+    std::unordered_multimap<size_t, c_type *> p_types{};
+    std::vector<std::unique_ptr<char[]>> p_lazy_src{};
+    std::size_t p_lazy_size = 0;
+    std::vector<lazy_decl> p_lazy{};
+    std::unordered_multimap<std::string, std::size_t> p_lazy_names{};
+    std::size_t p_lazy_pending = 0;
+    std::unique_ptr<conv_entry[]> p_conv{};
 };
 
 c_type from_lua_type(lua_State *L, int index);
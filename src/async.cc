@@ -0,0 +1,101 @@
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "async.hh"
+
+namespace async {
+
+/* blocking calls are the main use, so don't go below this many threads
+ * even on machines with few cores
+ */
+static constexpr unsigned MIN_THREADS = 4;
+
+struct worker_pool {
+    std::mutex mtx{};
+    std::condition_variable work_cv{};
+    std::condition_variable done_cv{};
+    std::deque<call *> queue{};
+    std::vector<std::thread> threads{};
+    bool stop = false;
+
+    ~worker_pool() {
+        {
+            std::lock_guard<std::mutex> l{mtx};
+            stop = true;
+        }
+        work_cv.notify_all();
+        for (auto &t: threads) {
+            t.join();
+        }
+    }
+
+    void run() {
+        for (;;) {
+            call *c;
+            {
+                std::unique_lock<std::mutex> l{mtx};
+                work_cv.wait(l, [this]() { return stop || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                c = queue.front();
+                queue.pop_front();
+            }
+            ffi_call(c->cif, c->sym, c->rval, c->args);
+            {
+                /* publish under the lock so that waiters can't miss it */
+                std::lock_guard<std::mutex> l{mtx};
+                c->finished.store(true, std::memory_order_release);
+            }
+            done_cv.notify_all();
+        }
+    }
+
+    /* call with the lock held */
+    void start() {
+        unsigned n = std::thread::hardware_concurrency();
+        if (n < MIN_THREADS) {
+            n = MIN_THREADS;
+        }
+        threads.reserve(n);
+        for (unsigned i = 0; i < n; ++i) {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+};
+
+static worker_pool &get_pool() {
+    static worker_pool wp{};
+    return wp;
+}
+
+void submit(call &c) {
+    auto &wp = get_pool();
+    c.finished.store(false, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> l{wp.mtx};
+        if (wp.threads.empty()) {
+            wp.start();
+        }
+        wp.queue.push_back(&c);
+    }
+    wp.work_cv.notify_one();
+}
+
+bool done(call const &c) {
+    return c.finished.load(std::memory_order_acquire);
+}
+
+void wait(call &c) {
+    if (done(c)) {
+        return;
+    }
+    auto &wp = get_pool();
+    std::unique_lock<std::mutex> l{wp.mtx};
+    wp.done_cv.wait(l, [&c]() { return done(c); });
+}
+
+} /* namespace async */
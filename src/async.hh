@@ -0,0 +1,40 @@
+#ifndef ASYNC_HH
+#define ASYNC_HH
+
+#include <cstddef>
+#include <atomic>
+
+#include "libffi.hh"
+
+/* A process-wide pool of native worker threads, used to run C calls off
+ * the Lua thread. The workers only ever deal with fully prepared calls,
+ * i.e. a cif, a symbol and already converted arguments; they never touch
+ * any Lua state, so everything to do with Lua values happens on the thread
+ * owning the state, before submitting and after completion.
+ *
+ * The threads are started on first use and stopped when the module is
+ * unloaded.
+ */
+
+namespace async {
+
+struct call {
+    ffi_cif *cif;
+    void (*sym)();
+    void *rval;
+    void **args;
+    std::atomic<bool> finished{false};
+};
+
+/* the call and everything it points to must stay alive until it's done */
+void submit(call &c);
+
+/* does not block */
+bool done(call const &c);
+
+/* blocks until the call has been performed */
+void wait(call &c);
+
+} /* namespace async */
+
+#endif /* ASYNC_HH */
@@ -1,28 +1,43 @@
+#include <new>
 #include <limits>
 #include <type_traits>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
 
 #include "platform.hh"
+#include "parser.hh"
 #include "ffi.hh"
+#include "pages.hh"
 
 namespace ffi {
 
 static inline void fail_convert_cd(
     lua_State *L, ast::c_type const &from, ast::c_type const &to
 ) {
-    luaL_error(
-        L, "cannot convert '%s' to '%s'",
-        from.serialize().c_str(), to.serialize().c_str()
-    );
+    /* the serialized names must be gone before the error unwinds */
+    luaL_where(L, 1);
+    {
+        auto fs = from.serialize();
+        auto ts = to.serialize();
+        lua_pushfstring(
+            L, "cannot convert '%s' to '%s'", fs.c_str(), ts.c_str()
+        );
+    }
+    lua_concat(L, 2);
+    lua_error(L);
 }
 
 static inline void fail_convert_tp(
     lua_State *L, char const *from, ast::c_type const &to
 ) {
-    luaL_error(
-        L, "cannot convert '%s' to '%s'",
-        from, to.serialize().c_str()
-    );
+    luaL_where(L, 1);
+    {
+        auto ts = to.serialize();
+        lua_pushfstring(L, "cannot convert '%s' to '%s'", from, ts.c_str());
+    }
+    lua_concat(L, 2);
+    lua_error(L);
 }
 
 static ffi_type *lua_to_vararg(lua_State *L, int index) {
@@ -45,10 +60,10 @@ static ffi_type *lua_to_vararg(lua_State *L, int index) {
         case LUA_TUSERDATA: {
             auto *cd = testcdata<noval>(L, index);
             /* plain userdata or struct values are passed to varargs as ptrs */
-            if (!cd || (cd->decl.type() == ast::C_BUILTIN_RECORD)) {
+            if (!cd || (cd->decl->type() == ast::C_BUILTIN_RECORD)) {
                 return &ffi_type_pointer;
             }
-            return cd->decl.libffi_type();
+            return cd->decl->libffi_type();
         }
         default:
             break;
@@ -61,34 +76,240 @@ static inline void *fdata_retval(fdata &fd) {
     return &fd.rarg;
 }
 
-static inline arg_stor_t *&fdata_get_aux(fdata &fd) {
-    union { arg_stor_t **np; arg_stor_t *op; } u;
+static inline ffi_type **fargs_types(void *args, size_t nargs) {
+    auto *bp = static_cast<arg_stor_t *>(args);
+    return reinterpret_cast<ffi_type **>(&bp[nargs]);
+}
+
+static inline void **fargs_values(void *args, size_t nargs) {
+    return reinterpret_cast<void **>(&fargs_types(args, nargs)[nargs]);
+}
+
+/* specialized argument converters for the common cases; these are picked
+ * once when a function cdata is created and return null when the Lua value
+ * is not the expected kind, in which case the generic from_lua takes over
+ */
+using arg_conv_f = void *(*)(lua_State *L, int index, void *stor);
+
+static inline arg_conv_f *fargs_convs(void *args, size_t nargs) {
+    return reinterpret_cast<arg_conv_f *>(&fargs_values(args, nargs)[nargs]);
+}
+
+template<typename T>
+static void *conv_arg_int(lua_State *L, int index, void *stor) {
+    if (lua_type(L, index) != LUA_TNUMBER) {
+        return nullptr;
+    }
+    *static_cast<T *>(stor) = T(lua_tointeger(L, index));
+    return stor;
+}
+
+template<typename T>
+static void *conv_arg_flt(lua_State *L, int index, void *stor) {
+    if (lua_type(L, index) != LUA_TNUMBER) {
+        return nullptr;
+    }
+    *static_cast<T *>(stor) = T(lua_tonumber(L, index));
+    return stor;
+}
+
+static void *conv_arg_str(lua_State *L, int index, void *stor) {
+    if (lua_type(L, index) != LUA_TSTRING) {
+        return nullptr;
+    }
+    *static_cast<char const **>(stor) = lua_tostring(L, index);
+    return stor;
+}
+
+static arg_conv_f get_arg_conv(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return nullptr;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_FLOAT: return conv_arg_flt<float>;
+        case ast::C_BUILTIN_DOUBLE: return conv_arg_flt<double>;
+        case ast::C_BUILTIN_LDOUBLE: return conv_arg_flt<long double>;
+        case ast::C_BUILTIN_BOOL: return conv_arg_int<bool>;
+        case ast::C_BUILTIN_CHAR: return conv_arg_int<char>;
+        case ast::C_BUILTIN_SCHAR: return conv_arg_int<signed char>;
+        case ast::C_BUILTIN_UCHAR: return conv_arg_int<unsigned char>;
+        case ast::C_BUILTIN_SHORT: return conv_arg_int<short>;
+        case ast::C_BUILTIN_USHORT: return conv_arg_int<unsigned short>;
+        case ast::C_BUILTIN_INT: return conv_arg_int<int>;
+        case ast::C_BUILTIN_UINT: return conv_arg_int<unsigned int>;
+        case ast::C_BUILTIN_LONG: return conv_arg_int<long>;
+        case ast::C_BUILTIN_ULONG: return conv_arg_int<unsigned long>;
+        case ast::C_BUILTIN_LLONG: return conv_arg_int<long long>;
+        case ast::C_BUILTIN_ULLONG: return conv_arg_int<unsigned long long>;
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM: return conv_arg_int<int>;
+        case ast::C_BUILTIN_PTR:
+            /* strings only convert to const char pointers */
+            if (
+                (tp.ptr_base().type() == ast::C_BUILTIN_CHAR) &&
+                (tp.ptr_base().cv() & ast::C_CV_CONST)
+            ) {
+                return conv_arg_str;
+            }
+            return nullptr;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+/* variadic functions need their call interface prepared according to the
+ * actual arguments, so we keep a few of the most recently used signatures
+ * around; calling again with the same argument shapes then does not need
+ * to prepare anything or allocate
+ *
+ * the argument buffer is shared by all signatures and has the same layout
+ * as with regular functions, only allocated dynamically and grown when
+ * needed (the types part of it is unused, each signature has its own)
+ */
+struct vararg_aux {
+    static constexpr size_t NSIGS = 4;
+
+    struct sig {
+        ffi_cif cif;
+        size_t nargs = 0;
+        ffi_type **targs = nullptr;
+    };
+
+    sig sigs[NSIGS];
+    size_t next = 0;
+    size_t nvals = 0;
+    arg_stor_t *vals = nullptr;
+
+    ~vararg_aux() {
+        for (auto &sg: sigs) {
+            delete[] sg.targs;
+        }
+        delete[] reinterpret_cast<unsigned char *>(vals);
+    }
+};
+
+static inline vararg_aux *&fdata_get_aux(fdata &fd) {
+    union { vararg_aux **np; arg_stor_t *op; } u;
     u.op = fd.args();
     return *u.np;
 }
 
 static inline void fdata_free_aux(fdata &fd) {
     auto &aux = fdata_get_aux(fd);
-    delete[] reinterpret_cast<unsigned char *>(aux);
+    delete aux;
     aux = nullptr;
 }
 
-static inline void fdata_new_aux(fdata &fd, size_t sz) {
-    fdata_get_aux(fd) = reinterpret_cast<arg_stor_t *>(new unsigned char[sz]);
+/* the references are kept in an intrusive list, so that dropping one when
+ * its cdata is collected does not have to search
+ */
+static void closure_ref(closure_data &cd, fdata &fd) {
+    fd.cd = &cd;
+    fd.rprev = nullptr;
+    fd.rnext = cd.refs;
+    if (cd.refs) {
+        cd.refs->rprev = &fd;
+    }
+    cd.refs = &fd;
 }
 
-static inline ffi_type **fargs_types(void *args, size_t nargs) {
-    auto *bp = static_cast<arg_stor_t *>(args);
-    return reinterpret_cast<ffi_type **>(&bp[nargs]);
+static void closure_unref(fdata &fd) {
+    if (fd.rprev) {
+        fd.rprev->rnext = fd.rnext;
+    } else {
+        fd.cd->refs = fd.rnext;
+    }
+    if (fd.rnext) {
+        fd.rnext->rprev = fd.rprev;
+    }
+    fd.cd = nullptr;
+    fd.rprev = fd.rnext = nullptr;
 }
 
-static inline void **fargs_values(void *args, size_t nargs) {
-    return reinterpret_cast<void **>(&fargs_types(args, nargs)[nargs]);
+std::atomic<int> alloc_stats_users{0};
+
+static alloc_stats &get_alloc_stats(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_ALLOC_STATS);
+    auto &st = *lua::touserdata<alloc_stats>(L, -1);
+    lua_pop(L, 1);
+    return st;
+}
+
+void stats_new(lua_State *L, cdata<noval> &cd, size_t bytes) {
+    auto &st = get_alloc_stats(L);
+    if (!st.enabled) {
+        return;
+    }
+    alloc_stats::entry *ent;
+    try {
+        ent = &st.types[cd.decl];
+    } catch (std::bad_alloc const &) {
+        /* leave it out rather than fail the allocation */
+        return;
+    }
+    cd.aux |= CDATA_AUX_COUNTED;
+    ++ent->live;
+    ++ent->allocs;
+    ent->bytes += bytes;
+    ++st.live;
+    ++st.allocs;
+    st.bytes += bytes;
+}
+
+void stats_extra(lua_State *L, cdata<noval> &cd, size_t bytes) {
+    auto &st = get_alloc_stats(L);
+    auto it = st.types.find(cd.decl);
+    if (it != st.types.end()) {
+        it->second.bytes += bytes;
+    }
+    st.bytes += bytes;
+}
+
+void stats_finalizer(lua_State *L, int diff) {
+    get_alloc_stats(L).finalizers += size_t(diff);
+}
+
+/* the cdata is at index 1, its block size is the same as when counted */
+static void stats_free(lua_State *L, cdata<noval> &cd) {
+    auto &st = get_alloc_stats(L);
+    if (st.closed) {
+        return;
+    }
+    size_t bytes = lua_rawlen(L, 1);
+    if (
+        (cd.decl->type() == ast::C_BUILTIN_ARRAY) &&
+        (cd.aux & CDATA_AUX_MAPPED)
+    ) {
+        bytes += cdata_mapped_size(cd);
+    }
+    auto it = st.types.find(cd.decl);
+    if (it != st.types.end()) {
+        --it->second.live;
+        it->second.bytes -= bytes;
+    }
+    --st.live;
+    st.bytes -= bytes;
+    if (cdata_has_finalizer(cd)) {
+        --st.finalizers;
+    }
 }
 
 void destroy_cdata(lua_State *L, cdata<noval> &cd) {
+    /* ctypes have no value, so there is nothing to release */
+    if (isctype(cd)) {
+        return;
+    }
+    if (cd.aux & CDATA_AUX_COUNTED) {
+        stats_free(L, cd);
+    }
     auto &fd = *reinterpret_cast<cdata<fdata> *>(&cd.decl);
-    if (cd.gc_ref >= 0) {
+    if (cd.gc_ref <= GC_NATIVE_BASE) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_NATIVE_GC);
+        auto *ng = lua::touserdata<native_gc>(L, -1);
+        lua_pop(L, 1);
+        ng->funcs[GC_NATIVE_BASE - cd.gc_ref](cd.get_addr());
+    } else if (cd.gc_ref >= 0) {
         lua_rawgeti(L, LUA_REGISTRYINDEX, cd.gc_ref);
         lua_pushvalue(L, 1); /* the cdata */
         if (lua_pcall(L, 1, 0, 0)) {
@@ -96,19 +317,28 @@ void destroy_cdata(lua_State *L, cdata<noval> &cd) {
         }
         luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
     }
-    if (cd.decl.closure() && fd.val.cd) {
-        /* this is O(n) which sucks a little */
-        fd.val.cd->refs.remove(&fd.val.cd);
+    if (cd.decl->closure() && fd.val.cd) {
+        auto *clo = fd.val.cd;
+        closure_unref(fd.val);
+        /* automatic callbacks die with the last handle */
+        if (clo->autocb && !clo->refs) {
+            destroy_closure(L, clo);
+        }
     }
-    switch (cd.decl.type()) {
+    switch (cd.decl->type()) {
+        case ast::C_BUILTIN_ARRAY:
+            if (cd.aux & CDATA_AUX_MAPPED) {
+                pages::unmap(cd.get_addr(), cdata_mapped_size(cd));
+            }
+            break;
         case ast::C_BUILTIN_PTR:
-            if (cd.decl.ptr_base().type() != ast::C_BUILTIN_FUNC) {
+            if (cd.decl->ptr_base().type() != ast::C_BUILTIN_FUNC) {
                 break;
             }
             goto free_aux;
         free_aux:
         case ast::C_BUILTIN_FUNC: {
-            if (!fd.decl.function().variadic()) {
+            if (!fd.decl->function().variadic()) {
                 break;
             }
             fdata_free_aux(fd.val);
@@ -116,38 +346,434 @@ void destroy_cdata(lua_State *L, cdata<noval> &cd) {
         default:
             break;
     }
-    using T = ast::c_type;
-    cd.decl.~T();
 }
 
-void destroy_closure(closure_data *cd) {
+static void closure_free(closure_data *cd) {
+    if (cd->closure) {
+        ffi_closure_free(cd->closure);
+    }
     cd->~closure_data();
     delete[] reinterpret_cast<unsigned char *>(cd);
 }
 
-static void cb_bind(ffi_cif *, void *ret, void *args[], void *data) {
-    auto &fud = *static_cast<cdata<fdata> *>(data);
-    auto &fun = fud.decl.function();
+void destroy_closure(lua_State *L, closure_data *cd) {
+    if (cd->queue) {
+        purge_queued(*cd->queue, cd);
+    }
+    /* invalidate any registered references to the closure data */
+    while (cd->refs) {
+        closure_unref(*cd->refs);
+    }
+    /* the thread the callback was running on may be gone by now */
+    if (cd->autocb) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_FUNCS);
+        luaL_unref(L, -1, cd->fref);
+        lua_pop(L, 1);
+        cd->autocb = false;
+    } else {
+        luaL_unref(L, LUA_REGISTRYINDEX, cd->fref);
+    }
+    cd->L = nullptr;
+    auto *pool = cd->pool;
+    --pool->live;
+    size_t nargs = cd->nargs;
+    if (
+        pool->closed || (nargs > closure_pool::MAX_ARGS) ||
+        (pool->nfree[nargs] >= closure_pool::MAX_CACHED)
+    ) {
+        closure_free(cd);
+        return;
+    }
+    cd->fref = LUA_REFNIL;
+    cd->queue = nullptr;
+    cd->owner = std::thread::id{};
+    cd->qwait = true;
+    cd->next = pool->free[nargs];
+    pool->free[nargs] = cd;
+    ++pool->nfree[nargs];
+}
+
+void closure_pool::close() {
+    closed = true;
+    for (size_t i = 0; i <= MAX_ARGS; ++i) {
+        while (free[i]) {
+            auto *next = free[i]->next;
+            closure_free(free[i]);
+            free[i] = next;
+        }
+        nfree[i] = 0;
+    }
+}
+
+/* takes a cached closure for the given number of arguments, or makes a new
+ * one; null if the trampoline could not be allocated
+ */
+static closure_data *closure_get(closure_pool &pool, size_t nargs) {
+    closure_data *cd = nullptr;
+    if ((nargs <= closure_pool::MAX_ARGS) && pool.free[nargs]) {
+        cd = pool.free[nargs];
+        pool.free[nargs] = cd->next;
+        --pool.nfree[nargs];
+        cd->next = nullptr;
+        ++pool.recycled;
+    } else {
+        cd = reinterpret_cast<closure_data *>(new unsigned char[
+            sizeof(closure_data) + nargs * sizeof(ffi_type *) +
+            nargs * sizeof(cb_arg_f)
+        ]);
+        new (cd) closure_data{};
+        cd->closure = static_cast<ffi_closure *>(
+            ffi_closure_alloc(sizeof(ffi_closure), &cd->code)
+        );
+        if (!cd->closure) {
+            closure_free(cd);
+            return nullptr;
+        }
+        cd->pool = &pool;
+        cd->nargs = nargs;
+        ++pool.created;
+    }
+    ++pool.live;
+    return cd;
+}
+
+/* callback conversions for scalars that map directly onto Lua values,
+ * i.e. the cases where to_lua and from_lua would not make any cdata
+ */
+#if LUA_VERSION_NUM < 503
+using cb_int_t = lua_Number;
+#else
+using cb_int_t = lua_Integer;
+#endif
+
+template<typename T>
+static cb_arg_f cb_arg_int() {
+    if (
+        std::numeric_limits<T>::digits > std::numeric_limits<cb_int_t>::digits
+    ) {
+        return nullptr;
+    }
+    return [](lua_State *L, void const *value) {
+        lua_pushinteger(L, lua_Integer(*static_cast<T const *>(value)));
+    };
+}
+
+template<typename T>
+static cb_arg_f cb_arg_flt() {
+    if (
+        std::numeric_limits<T>::max() > std::numeric_limits<lua_Number>::max()
+    ) {
+        return nullptr;
+    }
+    return [](lua_State *L, void const *value) {
+        lua_pushnumber(L, lua_Number(*static_cast<T const *>(value)));
+    };
+}
+
+template<typename T>
+static cb_ret_f cb_ret_int() {
+    return [](lua_State *L, void *ret) {
+        if (lua_type(L, -1) != LUA_TNUMBER) {
+            return false;
+        }
+        *static_cast<T *>(ret) = T(lua_tointeger(L, -1));
+        return true;
+    };
+}
+
+template<typename T>
+static cb_ret_f cb_ret_flt() {
+    return [](lua_State *L, void *ret) {
+        if (lua_type(L, -1) != LUA_TNUMBER) {
+            return false;
+        }
+        *static_cast<T *>(ret) = T(lua_tonumber(L, -1));
+        return true;
+    };
+}
+
+static cb_arg_f get_cb_arg(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return nullptr;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_BOOL:
+            return [](lua_State *L, void const *value) {
+                lua_pushboolean(L, *static_cast<bool const *>(value));
+            };
+        case ast::C_BUILTIN_FLOAT: return cb_arg_flt<float>();
+        case ast::C_BUILTIN_DOUBLE: return cb_arg_flt<double>();
+        case ast::C_BUILTIN_LDOUBLE: return cb_arg_flt<long double>();
+        case ast::C_BUILTIN_CHAR: return cb_arg_int<char>();
+        case ast::C_BUILTIN_SCHAR: return cb_arg_int<signed char>();
+        case ast::C_BUILTIN_UCHAR: return cb_arg_int<unsigned char>();
+        case ast::C_BUILTIN_SHORT: return cb_arg_int<short>();
+        case ast::C_BUILTIN_USHORT: return cb_arg_int<unsigned short>();
+        case ast::C_BUILTIN_INT: return cb_arg_int<int>();
+        case ast::C_BUILTIN_UINT: return cb_arg_int<unsigned int>();
+        case ast::C_BUILTIN_LONG: return cb_arg_int<long>();
+        case ast::C_BUILTIN_ULONG: return cb_arg_int<unsigned long>();
+        case ast::C_BUILTIN_LLONG: return cb_arg_int<long long>();
+        case ast::C_BUILTIN_ULLONG: return cb_arg_int<unsigned long long>();
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM: return cb_arg_int<int>();
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+static cb_ret_f get_cb_ret(ast::c_type const &tp) {
+    if (tp.is_ref()) {
+        return nullptr;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_FLOAT: return cb_ret_flt<float>();
+        case ast::C_BUILTIN_DOUBLE: return cb_ret_flt<double>();
+        case ast::C_BUILTIN_LDOUBLE: return cb_ret_flt<long double>();
+        case ast::C_BUILTIN_CHAR: return cb_ret_int<char>();
+        case ast::C_BUILTIN_SCHAR: return cb_ret_int<signed char>();
+        case ast::C_BUILTIN_UCHAR: return cb_ret_int<unsigned char>();
+        case ast::C_BUILTIN_SHORT: return cb_ret_int<short>();
+        case ast::C_BUILTIN_USHORT: return cb_ret_int<unsigned short>();
+        case ast::C_BUILTIN_INT: return cb_ret_int<int>();
+        case ast::C_BUILTIN_UINT: return cb_ret_int<unsigned int>();
+        case ast::C_BUILTIN_LONG: return cb_ret_int<long>();
+        case ast::C_BUILTIN_ULONG: return cb_ret_int<unsigned long>();
+        case ast::C_BUILTIN_LLONG: return cb_ret_int<long long>();
+        case ast::C_BUILTIN_ULLONG: return cb_ret_int<unsigned long long>();
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM: return cb_ret_int<int>();
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+static void cb_call(
+    lua_State *L, closure_data &cd, void *ret, void *args[]
+) {
+    auto &fun = *cd.func;
     auto &pars = fun.params();
     size_t fargs = pars.size();
 
-    closure_data &cd = *fud.val.cd;
-    lua_rawgeti(cd.L, LUA_REGISTRYINDEX, cd.fref);
+    cb_arg_f *aconvs = cd.aconvs();
+    if (cd.autocb) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_FUNCS);
+        lua_rawgeti(L, -1, cd.fref);
+        lua_remove(L, -2);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cd.fref);
+    }
     for (size_t i = 0; i < fargs; ++i) {
-        to_lua(cd.L, pars[i].type(), args[i], RULE_PASS);
+        if (aconvs[i]) {
+            aconvs[i](L, args[i]);
+        } else {
+            to_lua(L, pars[i].type(), args[i], RULE_PASS);
+        }
     }
 
     if (fun.result().type() != ast::C_BUILTIN_VOID) {
-        lua_call(cd.L, int(fargs), 1);
-        arg_stor_t stor;
-        size_t rsz;
-        void *rp = from_lua(
-            cd.L, fun.result(), &stor, -1, rsz, RULE_RET
-        );
-        memcpy(ret, rp, rsz);
-        lua_pop(cd.L, 1);
+        lua_call(L, int(fargs), 1);
+        if (!cd.rconv || !cd.rconv(L, ret)) {
+            arg_stor_t stor;
+            size_t rsz;
+            void *rp = from_lua(
+                L, fun.result(), &stor, -1, rsz, RULE_RET
+            );
+            memcpy(ret, rp, rsz);
+        }
+        lua_pop(L, 1);
+    } else {
+        lua_call(L, int(fargs), 0);
+    }
+}
+
+/* a queued invocation; the result storage follows, then copies of the
+ * arguments, then pointers to them
+ */
+struct cb_entry {
+    cb_entry *next = nullptr;
+    closure_data *cd;
+    void *ret;
+    void **args;
+    bool wait;
+    bool done = false;
+    std::mutex mtx{};
+    std::condition_variable cv{};
+
+    arg_stor_t *stor() {
+        union { arg_stor_t *av; cb_entry *ce; } u;
+        u.ce = this + 1;
+        return u.av;
+    }
+};
+
+static inline size_t cb_slots(size_t sz) {
+    size_t ret = (sz + sizeof(arg_stor_t) - 1) / sizeof(arg_stor_t);
+    return ret ? ret : 1;
+}
+
+static void cb_entry_free(cb_entry *e) {
+    e->~cb_entry();
+    delete[] reinterpret_cast<unsigned char *>(e);
+}
+
+/* finishes an entry taken off the queue; waiting threads own theirs */
+static void cb_entry_release(cb_entry *e) {
+    if (!e->wait) {
+        cb_entry_free(e);
+        return;
+    }
+    /* notify under the lock, the waiter frees the entry once it's done */
+    std::lock_guard<std::mutex> l{e->mtx};
+    e->done = true;
+    e->cv.notify_one();
+}
+
+static void cb_enqueue(
+    closure_data &cd, ffi_cif *cif, void *ret, void *args[]
+) {
+    size_t nargs = cif->nargs;
+    bool rvoid = (cif->rtype->type == FFI_TYPE_VOID);
+    /* small scalar results are written as a whole ffi_arg */
+    size_t rsz = cif->rtype->size;
+    if (cif->rtype->type != FFI_TYPE_STRUCT) {
+        rsz = std::max(rsz, sizeof(ffi_arg));
+    }
+    size_t nslots = cb_slots(rsz);
+    for (size_t i = 0; i < nargs; ++i) {
+        nslots += cb_slots(cif->arg_types[i]->size);
+    }
+    auto *e = reinterpret_cast<cb_entry *>(new unsigned char[
+        sizeof(cb_entry) + nslots * sizeof(arg_stor_t) +
+        nargs * sizeof(void *)
+    ]);
+    new (e) cb_entry{};
+    e->cd = &cd;
+    e->wait = cd.qwait;
+
+    arg_stor_t *sp = e->stor();
+    e->ret = sp;
+    memset(sp, 0, cb_slots(rsz) * sizeof(arg_stor_t));
+    sp += cb_slots(rsz);
+    e->args = reinterpret_cast<void **>(&e->stor()[nslots]);
+    for (size_t i = 0; i < nargs; ++i) {
+        memcpy(sp, args[i], cif->arg_types[i]->size);
+        e->args[i] = sp;
+        sp += cb_slots(cif->arg_types[i]->size);
+    }
+
+    /* wait for the result if needed before touching the entry again */
+    bool wait = e->wait;
+    auto &head = cd.queue->head;
+    e->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(
+        e->next, e, std::memory_order_release, std::memory_order_relaxed
+    )) {}
+    if (!wait) {
+        if (!rvoid) {
+            memset(ret, 0, rsz);
+        }
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> l{e->mtx};
+        e->cv.wait(l, [e]() { return e->done; });
+    }
+    if (!rvoid) {
+        memcpy(ret, e->ret, rsz);
+    }
+    cb_entry_free(e);
+}
+
+static void cb_bind(ffi_cif *cif, void *ret, void *args[], void *data) {
+    closure_data &cd = *static_cast<closure_data *>(data);
+    if (cd.queue && (std::this_thread::get_id() != cd.owner)) {
+        cb_enqueue(cd, cif, ret, args);
+        return;
+    }
+    cb_call(cd.L, cd, ret, args);
+}
+
+/* moves everything pushed by other threads into the pending list */
+static void cb_collect(cb_queue &q) {
+    auto *e = q.head.exchange(nullptr, std::memory_order_acquire);
+    /* the pushed entries are newest first */
+    cb_entry *first = nullptr;
+    cb_entry *last = e;
+    while (e) {
+        auto *next = e->next;
+        e->next = first;
+        first = e;
+        e = next;
+    }
+    if (!first) {
+        return;
+    }
+    if (q.pending_last) {
+        q.pending_last->next = first;
     } else {
-        lua_call(cd.L, int(fargs), 0);
+        q.pending = first;
+    }
+    q.pending_last = last;
+}
+
+void queue_closure(lua_State *L, closure_data &cd, bool wait) {
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_QUEUE);
+    cd.queue = lua::touserdata<cb_queue>(L, -1);
+    lua_pop(L, 1);
+    cd.owner = std::this_thread::get_id();
+    cd.qwait = wait;
+}
+
+static int dispatch_one(lua_State *L) {
+    auto *e = static_cast<cb_entry *>(lua_touserdata(L, 1));
+    cb_call(L, *e->cd, e->ret, e->args);
+    return 0;
+}
+
+size_t dispatch_queued(lua_State *L, cb_queue &q, size_t max) {
+    cb_collect(q);
+    size_t n = 0;
+    while (q.pending && (!max || (n < max))) {
+        auto *e = q.pending;
+        q.pending = e->next;
+        if (!q.pending) {
+            q.pending_last = nullptr;
+        }
+        lua_pushcfunction(L, dispatch_one);
+        lua_pushlightuserdata(L, e);
+        if (lua_pcall(L, 1, 0, 0)) {
+            /* don't leave the calling thread hanging */
+            cb_entry_release(e);
+            lua_error(L);
+        }
+        cb_entry_release(e);
+        ++n;
+    }
+    return n;
+}
+
+void purge_queued(cb_queue &q, closure_data const *cd) {
+    cb_collect(q);
+    cb_entry *prev = nullptr;
+    for (auto *e = q.pending; e;) {
+        auto *next = e->next;
+        if (!cd || (e->cd == cd)) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                q.pending = next;
+            }
+            if (q.pending_last == e) {
+                q.pending_last = prev;
+            }
+            cb_entry_release(e);
+        } else {
+            prev = e;
+        }
+        e = next;
     }
 }
 
@@ -216,6 +842,9 @@ static void make_cdata_func(
      *         void *valp1;    // &val1
      *         void *valpN;    // &val2
      *         void *valpN;    // &valN
+     *         arg_conv_f conv1; // specialized converter for arg1 or null
+     *         arg_conv_f conv2; // specialized converter for arg2 or null
+     *         arg_conv_f convN; // specialized converter for argN or null
      *     } val;
      * }
      *
@@ -225,7 +854,8 @@ static void make_cdata_func(
      *     <cdata header>
      *     struct fdata {
      *         <fdata header>
-     *         void *aux; // vals + types + args like above, but dynamic
+     *         vararg_aux *aux; // vals + args like above but dynamic,
+     *                          // plus prepared signatures
      *     } val;
      * }
      */
@@ -233,10 +863,12 @@ static void make_cdata_func(
     auto &fud = newcdata<fdata>(
         L, fptr ? ast::c_type{std::move(funct), 0} : std::move(funct),
         func.variadic() ? sizeof(void *) : (
-            sizeof(arg_stor_t) * nargs + sizeof(void *) * nargs * 2
+            sizeof(arg_stor_t) * nargs + sizeof(void *) * nargs * 2 +
+            sizeof(arg_conv_f) * nargs
         )
     );
     fud.val.sym = funp;
+    fud.val.cd = nullptr;
 
     if (func.variadic()) {
         fdata_get_aux(fud.val) = nullptr;
@@ -252,83 +884,143 @@ static void make_cdata_func(
         luaL_error(L, "unexpected failure setting up '%s'", func.name());
     }
 
+    auto *convs = fargs_convs(fud.val.args(), nargs);
+    for (size_t i = 0; i < nargs; ++i) {
+        convs[i] = get_arg_conv(func.params()[i].type());
+    }
+
     if (!funp) {
         /* no funcptr means we're setting up a callback */
         if (cd) {
             /* copying existing callback reference */
-            cd->refs.push_front(&fud.val.cd);
-            fud.val.cd = cd;
+            fud.val.sym = reinterpret_cast<void (*)()>(cd->code);
+            closure_ref(*cd, fud.val);
             return;
         }
-        cd = reinterpret_cast<closure_data *>(new unsigned char[
-            sizeof(closure_data) + nargs * sizeof(ffi_type *)
-        ]);
-        new (cd) closure_data{};
-        /* allocate a closure in it */
-        cd->closure = static_cast<ffi_closure *>(ffi_closure_alloc(
-            sizeof(ffi_closure), reinterpret_cast<void **>(&fud.val.sym)
-        ));
-        if (!cd->closure) {
-            destroy_closure(cd);
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+        auto &pool = *lua::touserdata<closure_pool>(L, -1);
+        lua_pop(L, 1);
+        /* get a closure, possibly a previously freed one */
+        cd = closure_get(pool, nargs);
+        if (!cd) {
             luaL_error(
                 L, "failed allocating callback for '%s'",
                 func.serialize().c_str()
             );
         }
-        if (!prepare_cif(fud.decl.function(), cd->cif, cd->targs(), nargs)) {
-            destroy_closure(cd);
-            luaL_error(L, "unexpected failure setting up '%s'", func.name());
+        /* pick the conversions once, so invoking does not dispatch */
+        auto *aconvs = cd->aconvs();
+        for (size_t i = 0; i < nargs; ++i) {
+            aconvs[i] = get_cb_arg(func.params()[i].type());
         }
-        if (ffi_prep_closure_loc(
-            cd->closure, &fud.val.cif, cb_bind, &fud,
-            reinterpret_cast<void *>(fud.val.sym)
-        ) != FFI_OK) {
-            destroy_closure(cd);
+        cd->rconv = get_cb_ret(func.result());
+        cd->func = &fud.decl->function();
+        cd->L = L;
+        if (
+            !prepare_cif(*cd->func, cd->cif, cd->targs(), nargs) ||
+            (ffi_prep_closure_loc(
+                cd->closure, &cd->cif, cb_bind, cd, cd->code
+            ) != FFI_OK)
+        ) {
+            destroy_closure(L, cd);
             luaL_error(
                 L, "failed initializing closure for '%s'",
                 func.serialize().c_str()
             );
         }
-        cd->L = L;
+        fud.val.sym = reinterpret_cast<void (*)()>(cd->code);
         /* register this reference within the closure */
-        cd->refs.push_front(&fud.val.cd);
-        fud.val.cd = cd;
+        closure_ref(*cd, fud.val);
     }
 }
 
-static bool prepare_cif_var(
+static ffi_cif *prepare_cif_var(
     lua_State *L, cdata<fdata> &fud, size_t nargs, size_t fargs
 ) {
-    auto &func = fud.decl.function();
+    auto &func = fud.decl->function();
 
-    auto &auxptr = fdata_get_aux(fud.val);
-    if (auxptr && (nargs > size_t(fud.aux))) {
-        fdata_free_aux(fud.val);
+    auto *&aux = fdata_get_aux(fud.val);
+    if (!aux) {
+        aux = new vararg_aux{};
     }
-    if (!auxptr) {
-        fdata_new_aux(
-            fud.val, nargs * sizeof(arg_stor_t) + 2 * nargs * sizeof(void *)
-        );
-        fud.aux = int(nargs);
+    if (nargs > aux->nvals) {
+        delete[] reinterpret_cast<unsigned char *>(aux->vals);
+        aux->vals = reinterpret_cast<arg_stor_t *>(new unsigned char[
+            nargs * sizeof(arg_stor_t) + 2 * nargs * sizeof(void *)
+        ]);
+        aux->nvals = nargs;
     }
 
-    ffi_type **targs = fargs_types(auxptr, nargs);
+    /* the fixed part is always the same, so only compare the rest */
+    for (auto &sg: aux->sigs) {
+        if (!sg.targs || (sg.nargs != nargs)) {
+            continue;
+        }
+        size_t i = fargs;
+        for (; i < nargs; ++i) {
+            if (sg.targs[i] != lua_to_vararg(L, int(i + 2))) {
+                break;
+            }
+        }
+        if (i == nargs) {
+            return &sg.cif;
+        }
+    }
+
+    /* not seen yet, replace the oldest one */
+    auto &sg = aux->sigs[aux->next];
+    aux->next = (aux->next + 1) % vararg_aux::NSIGS;
+
+    if (!sg.targs || (sg.nargs < nargs)) {
+        delete[] sg.targs;
+        sg.targs = new ffi_type *[nargs ? nargs : 1];
+    }
+    sg.nargs = nargs;
     for (size_t i = 0; i < fargs; ++i) {
-        targs[i] = func.params()[i].libffi_type();
+        sg.targs[i] = func.params()[i].libffi_type();
     }
     for (size_t i = fargs; i < nargs; ++i) {
-        targs[i] = lua_to_vararg(L, int(i + 2));
+        sg.targs[i] = lua_to_vararg(L, int(i + 2));
     }
 
     using U = unsigned int;
-    return (ffi_prep_cif_var(
-        &fud.val.cif, to_libffi_abi(func.callconv()), U(fargs), U(nargs),
-        func.result().libffi_type(), targs
-    ) == FFI_OK);
+    if (ffi_prep_cif_var(
+        &sg.cif, to_libffi_abi(func.callconv()), U(fargs), U(nargs),
+        func.result().libffi_type(), sg.targs
+    ) != FFI_OK) {
+        /* don't let a broken signature match later */
+        delete[] sg.targs;
+        sg.targs = nullptr;
+        return nullptr;
+    }
+    return &sg.cif;
+}
+
+static int push_retval(
+    lua_State *L, ast::c_function const &func, void *rval
+) {
+#ifdef FFI_BIG_ENDIAN
+    /* for small return types, ffi_arg must be used to hold the result,
+     * and it is assumed that they will be accessed like integers via
+     * the ffi_arg; that also means that on big endian systems the
+     * value will be stored in the latter part of the memory...
+     *
+     * we're taking an address to the beginning in general, so make
+     * a special case here; only small types will have this problem
+     *
+     * there shouldn't be any other places that make this assumption
+     */
+    auto rsz = func.result().alloc_size();
+    if (rsz < sizeof(ffi_arg)) {
+        auto *p = static_cast<unsigned char *>(rval);
+        rval = p + sizeof(ffi_arg) - rsz;
+    }
+#endif
+    return to_lua(L, func.result(), rval, RULE_RET);
 }
 
 int call_cif(cdata<fdata> &fud, lua_State *L, size_t largs) {
-    auto &func = fud.decl.function();
+    auto &func = fud.decl->function();
     auto &pdecls = func.params();
 
     size_t nargs = pdecls.size();
@@ -336,18 +1028,27 @@ int call_cif(cdata<fdata> &fud, lua_State *L, size_t largs) {
 
     arg_stor_t *pvals = fud.val.args();
     void *rval = fdata_retval(fud.val);
+    ffi_cif *cif = &fud.val.cif;
 
     if (func.variadic()) {
         targs = std::max(largs, nargs);
-        if (!prepare_cif_var(L, fud, targs, nargs)) {
+        cif = prepare_cif_var(L, fud, targs, nargs);
+        if (!cif) {
             luaL_error(L, "unexpected failure setting up '%s'", func.name());
         }
-        pvals = fdata_get_aux(fud.val);
+        pvals = fdata_get_aux(fud.val)->vals;
     }
 
     void **vals = fargs_values(pvals, targs);
-    /* fixed args */
+    /* fixed args; try the specialized converters first when we have them */
+    arg_conv_f *convs = func.variadic() ? nullptr : fargs_convs(pvals, targs);
     for (int i = 0; i < int(nargs); ++i) {
+        if (convs && convs[i]) {
+            vals[i] = convs[i](L, i + 2, &pvals[i]);
+            if (vals[i]) {
+                continue;
+            }
+        }
         size_t rsz;
         vals[i] = from_lua(
             L, pdecls[i].type(), &pvals[i], i + 2, rsz, RULE_PASS
@@ -366,25 +1067,107 @@ int call_cif(cdata<fdata> &fud, lua_State *L, size_t largs) {
         vals[i] = from_lua(L, std::move(tp), &pvals[i], i + 2, rsz, RULE_PASS);
     }
 
-    ffi_call(&fud.val.cif, fud.val.sym, rval, vals);
-#ifdef FFI_BIG_ENDIAN
-    /* for small return types, ffi_arg must be used to hold the result,
-     * and it is assumed that they will be accessed like integers via
-     * the ffi_arg; that also means that on big endian systems the
-     * value will be stored in the latter part of the memory...
-     *
-     * we're taking an address to the beginning in general, so make
-     * a special case here; only small types will have this problem
-     *
-     * there shouldn't be any other places that make this assumption
-     */
-    auto rsz = func.result().alloc_size();
-    if (rsz < sizeof(ffi_arg)) {
-        auto *p = static_cast<unsigned char *>(rval);
-        rval = p + sizeof(ffi_arg) - rsz;
+    ffi_call(cif, fud.val.sym, rval, vals);
+    return push_retval(L, func, rval);
+}
+
+static inline size_t stor_slots(size_t sz) {
+    return (sz + sizeof(arg_stor_t) - 1) / sizeof(arg_stor_t);
+}
+
+void async_cif(cdata<fdata> &fud, lua_State *L, size_t largs) {
+    auto &func = fud.decl->function();
+    auto &pdecls = func.params();
+    if (func.variadic()) {
+        luaL_error(L, "variadic functions cannot be called asynchronously");
     }
-#endif
-    return to_lua(L, func.result(), rval, RULE_RET);
+    if (fud.decl->closure()) {
+        luaL_error(L, "callbacks cannot be called asynchronously");
+    }
+    size_t nargs = pdecls.size();
+    /* nothing may call back into lua from the worker threads */
+    for (int i = 0; i < int(nargs); ++i) {
+        bool cb = (lua_type(L, i + 2) == LUA_TFUNCTION);
+        if (!cb) {
+            auto *cd = testcdata<noval>(L, i + 2);
+            cb = cd && !isctype(*cd) && cd->decl->closure();
+        }
+        if (cb) {
+            luaL_error(
+                L, "callbacks cannot be passed to asynchronous calls "
+                   "(argument %d)", i + 1
+            );
+        }
+    }
+
+    /* result storage in units of arg_stor_t */
+    size_t rslots = stor_slots(func.result().alloc_size());
+    if (!rslots) {
+        rslots = 1;
+    }
+    /* records passed by value get copied in after the argument values */
+    size_t cslots = 0;
+    for (auto &p: pdecls) {
+        if (!p.type().is_ref() && (p.type().type() == ast::C_BUILTIN_RECORD)) {
+            cslots += stor_slots(p.type().alloc_size());
+        }
+    }
+    auto *ah = static_cast<async_handle *>(lua_newuserdata(
+        L, sizeof(async_handle) + (rslots + cslots) * sizeof(arg_stor_t) +
+           nargs * (sizeof(arg_stor_t) + sizeof(void *))
+    ));
+    new (ah) async_handle{};
+    luaL_setmetatable(L, lua::CFFI_ASYNC_MT);
+    ah->func = &func;
+
+    arg_stor_t *pvals = &ah->stor()[rslots];
+    arg_stor_t *cvals = &pvals[nargs];
+    auto **vals = reinterpret_cast<void **>(&cvals[cslots]);
+    arg_conv_f *convs = fargs_convs(fud.val.args(), nargs);
+    for (int i = 0; i < int(nargs); ++i) {
+        if (convs[i]) {
+            vals[i] = convs[i](L, i + 2, &pvals[i]);
+            if (vals[i]) {
+                continue;
+            }
+        }
+        auto &tp = pdecls[i].type();
+        size_t rsz;
+        vals[i] = from_lua(L, tp, &pvals[i], i + 2, rsz, RULE_PASS);
+        if (vals[i] == &pvals[i]) {
+            continue;
+        }
+        /* the value lives in some cdata, which lua may change while the
+         * call is still waiting to be run, so take a copy of it now
+         */
+        void *dst = &pvals[i];
+        if (tp.type() == ast::C_BUILTIN_RECORD) {
+            dst = cvals;
+            cvals += stor_slots(tp.alloc_size());
+        }
+        memcpy(dst, vals[i], tp.alloc_size());
+        vals[i] = dst;
+    }
+
+    /* keep the function and anything the arguments may point into alive */
+    lua_createtable(L, int(largs + 1), 0);
+    for (int i = 1; i <= int(largs + 1); ++i) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i);
+    }
+    ah->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    ah->call.cif = &fud.val.cif;
+    ah->call.sym = fud.val.sym;
+    ah->call.rval = ah->stor();
+    ah->call.args = vals;
+    async::submit(ah->call);
+    ah->submitted = true;
+}
+
+int async_result(lua_State *L, async_handle &ah) {
+    async::wait(ah.call);
+    return push_retval(L, *ah.func, ah.call.rval);
 }
 
 template<typename T>
@@ -671,11 +1454,15 @@ static inline bool func_convertible(
     return true;
 }
 
-static inline bool ptr_convertible(
-    ast::c_type const &from, ast::c_type const &to
+static bool ptr_convertible(
+    lua_State *L, ast::c_type const &from, ast::c_type const &to
 ) {
     auto &fpb = from.is_ref() ? from : from.ptr_base();
     auto &tpb = to.is_ref() ? to : to.ptr_base();
+    if (&fpb == &tpb) {
+        /* interned types with the same base, the common case */
+        return true;
+    }
     if (!cv_convertible(fpb.cv(), tpb.cv())) {
         return false;
     }
@@ -690,9 +1477,88 @@ static inline bool ptr_convertible(
         (fpb.type() == ast::C_BUILTIN_PTR) &&
         (tpb.type() == ast::C_BUILTIN_PTR)
     ) {
-        return ptr_convertible(fpb, tpb);
+        return ptr_convertible(L, fpb, tpb);
+    }
+    if (
+        (fpb.type() != ast::C_BUILTIN_FUNC) ||
+        !fpb.interned() || !tpb.interned()
+    ) {
+        return fpb.is_same(tpb, true, true);
     }
-    return fpb.is_same(tpb, true, true);
+    /* comparing signatures is not cheap, so remember the verdict */
+    auto &ds = ast::decl_store::get_main(L);
+    int ok = ds.conv_get(&fpb, &tpb);
+    if (ok < 0) {
+        ok = fpb.is_same(tpb, true, true);
+        ds.conv_set(&fpb, &tpb, !!ok);
+    }
+    return !!ok;
+}
+
+bool set_native_gc(lua_State *L, cdata<noval> &cd, int idx) {
+    auto *fd = testcdata<fdata>(L, idx);
+    if (!fd || isctype(*fd) || fd->decl->closure() || !fd->val.sym) {
+        return false;
+    }
+    auto *ft = fd->decl;
+    if (ft->type() == ast::C_BUILTIN_PTR) {
+        ft = &ft->ptr_base();
+    }
+    if (ft->type() != ast::C_BUILTIN_FUNC) {
+        return false;
+    }
+    auto &func = ft->function();
+    switch (func.callconv()) {
+        case ast::C_FUNC_DEFAULT:
+        case ast::C_FUNC_CDECL:
+            break;
+        default:
+            return false;
+    }
+    if (
+        func.variadic() || (func.params().size() != 1) ||
+        (func.result().type() != ast::C_BUILTIN_VOID)
+    ) {
+        return false;
+    }
+    /* the value must be passable as is, like a call would do it */
+    auto &pt = func.params()[0].type();
+    if (
+        (pt.type() != ast::C_BUILTIN_PTR) || pt.is_ref() ||
+        cd.decl->is_ref()
+    ) {
+        return false;
+    }
+    switch (cd.decl->type()) {
+        case ast::C_BUILTIN_PTR:
+        case ast::C_BUILTIN_ARRAY:
+            break;
+        default:
+            return false;
+    }
+    if (!ptr_convertible(L, *cd.decl, pt)) {
+        return false;
+    }
+    using F = void (*)(void *);
+    auto *fp = reinterpret_cast<F>(fd->val.sym);
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_NATIVE_GC);
+    auto &ng = *lua::touserdata<native_gc>(L, -1);
+    lua_pop(L, 1);
+    size_t fi = 0;
+    while ((fi < ng.nfuncs) && (ng.funcs[fi] != fp)) {
+        ++fi;
+    }
+    if (fi == ng.nfuncs) {
+        if (ng.nfuncs == native_gc::MAX_FUNCS) {
+            return false;
+        }
+        ng.funcs[ng.nfuncs++] = fp;
+    }
+    if (cd.gc_ref >= 0) {
+        luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
+    }
+    cd.gc_ref = GC_NATIVE_BASE - int(fi);
+    return true;
 }
 
 /* converting from cdata: pointer */
@@ -751,7 +1617,7 @@ isptr:
         /* then init from address */
         return;
     }
-    if (!ptr_convertible(cd, tp)) {
+    if (!ptr_convertible(L, cd, tp)) {
         fail_convert_cd(L, cd, tp);
     }
 }
@@ -879,6 +1745,11 @@ static void *from_lua_cdata(
             dsz = sizeof(void *);
             return sval;
         case ast::C_BUILTIN_RECORD:
+            /* passed by value; the callee gets a copy made by libffi */
+            if ((rule == RULE_PASS) && cd.is_same(tp, true)) {
+                dsz = cd.alloc_size();
+                return sval;
+            }
             /* we can initialize pointers and references by address */
             if ((tp.type() != ast::C_BUILTIN_PTR) && !tp.is_ref()) {
                 break;
@@ -929,6 +1800,68 @@ static void *from_lua_cdata(
     return nullptr;
 }
 
+/* lua functions passed to C functions get a callback made for them, which
+ * is cached for the function and the signature; the cache is weak-keyed and
+ * the callback only refers to the function through the weak-valued function
+ * table, so nothing points back at the key and the callback exists for as
+ * long as the function is otherwise alive, even without ephemerons on 5.1
+ *
+ * the callback runs on the thread which last passed it to C, which may be
+ * a coroutine; that thread is kept in the cache next to the callback, so
+ * that it stays alive for as long as the callback does
+ */
+static void *auto_callback(lua_State *L, ast::c_type const &tp, int index) {
+    if (index < 0) {
+        index += lua_gettop(L) + 1;
+    }
+    /* identical signatures are represented by the same interned type */
+    auto *key = const_cast<ast::c_type *>(&ast::decl_store::intern(L, tp));
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_CACHE);
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, index);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        auto *cd = tocdata<fdata>(L, -1).val.cd;
+        if (cd->L != L) {
+            /* cache[func][callback] = thread */
+            lua_pushthread(L);
+            lua_rawset(L, -3);
+            cd->L = L;
+            lua_pop(L, 2);
+        } else {
+            lua_pop(L, 3);
+        }
+        return cd->code;
+    }
+    lua_pop(L, 1);
+    make_cdata_func(
+        L, nullptr, tp.function(), tp.type() == ast::C_BUILTIN_PTR, nullptr
+    );
+    auto *cd = tocdata<fdata>(L, -1).val.cd;
+    lua_pushvalue(L, -1);
+    lua_pushthread(L);
+    lua_rawset(L, -4);
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_FUNCS);
+    lua_pushvalue(L, index);
+    cd->fref = luaL_ref(L, -2);
+    cd->autocb = true;
+    lua_pop(L, 1);
+    /* cache[func][signature] = callback */
+    lua_pushlightuserdata(L, key);
+    lua_insert(L, -2);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+    return cd->code;
+}
+
 void *from_lua(
     lua_State *L, ast::c_type const &tp, void *stor, int index,
     size_t &dsz, int rule
@@ -984,7 +1917,7 @@ void *from_lua(
             if (iscdata(L, index)) {
                 auto &cd = *lua::touserdata<cdata<void *>>(L, index);
                 return from_lua_cdata(
-                    L, cd.decl, tp, &cd.val, stor, dsz, rule
+                    L, *cd.decl, tp, &cd.val, stor, dsz, rule
                 );
             }
             auto tpt = tp.type();
@@ -1045,6 +1978,12 @@ void *from_lua(
             if (!tp.callable()) {
                 fail_convert_tp(L, "function", tp);
             }
+            if (rule == RULE_PASS) {
+                dsz = sizeof(void *);
+                return &(
+                    *static_cast<void **>(stor) = auto_callback(L, tp, index)
+                );
+            }
             lua_pushvalue(L, index);
             *static_cast<int *>(stor) = luaL_ref(L, LUA_REGISTRYINDEX);
             /* we don't have a value to store */
@@ -1165,6 +2104,182 @@ static void from_lua_table_record(
     }
 }
 
+/* bulk conversions between Lua tables and arrays of arithmetic types; the
+ * type dispatch is done once for the whole array, Lua numbers and booleans
+ * are then converted directly while anything else goes through the generic
+ * path, so the semantics are the same as converting each element separately
+ */
+template<ast::c_builtin B>
+static void from_lua_array_t(
+    lua_State *L, ast::c_type const &tp, void *dst, int tidx, int sidx,
+    size_t n
+) {
+    using T = ast::builtin_t<B>;
+    auto *p = static_cast<T *>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        lua_rawgeti(L, tidx, lua_Integer(sidx) + lua_Integer(i));
+        size_t esz;
+        switch (lua_type(L, -1)) {
+            case LUA_TNUMBER:
+            case LUA_TBOOLEAN:
+                if (std::is_floating_point<T>::value) {
+                    write_flt<T>(L, -1, &p[i], esz);
+                } else {
+                    write_int<T>(L, -1, &p[i], esz);
+                }
+                break;
+            default: {
+                arg_stor_t sv{};
+                void *ep = from_lua(L, tp, &sv, -1, esz, RULE_CONV);
+                memcpy(&p[i], ep, sizeof(T));
+                break;
+            }
+        }
+        lua_pop(L, 1);
+    }
+}
+
+template<ast::c_builtin B>
+static void to_lua_array_t(
+    lua_State *L, ast::c_type const &tp, void const *src, int tidx, int sidx,
+    size_t n
+) {
+    using T = ast::builtin_t<B>;
+    auto *p = static_cast<T const *>(src);
+    for (size_t i = 0; i < n; ++i) {
+        if (std::is_same<T, bool>::value) {
+            lua_pushboolean(L, bool(p[i]));
+        } else if (std::is_floating_point<T>::value) {
+            push_flt<T>(L, tp, &p[i], false);
+        } else {
+            push_int<T>(L, tp, &p[i], false);
+        }
+        lua_rawseti(L, tidx, lua_Integer(sidx) + lua_Integer(i));
+    }
+}
+
+bool from_lua_array(
+    lua_State *L, ast::c_type const &tp, void *dst, int tidx, int sidx,
+    size_t n
+) {
+    if (tp.is_ref()) {
+        return false;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_FLOAT:
+            from_lua_array_t<ast::C_BUILTIN_FLOAT>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_DOUBLE:
+            from_lua_array_t<ast::C_BUILTIN_DOUBLE>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LDOUBLE:
+            from_lua_array_t<ast::C_BUILTIN_LDOUBLE>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_BOOL:
+            from_lua_array_t<ast::C_BUILTIN_BOOL>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_CHAR:
+            from_lua_array_t<ast::C_BUILTIN_CHAR>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_SCHAR:
+            from_lua_array_t<ast::C_BUILTIN_SCHAR>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_UCHAR:
+            from_lua_array_t<ast::C_BUILTIN_UCHAR>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_SHORT:
+            from_lua_array_t<ast::C_BUILTIN_SHORT>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_USHORT:
+            from_lua_array_t<ast::C_BUILTIN_USHORT>(L, tp, dst, tidx, sidx, n);
+            return true;
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM:
+        case ast::C_BUILTIN_INT:
+            from_lua_array_t<ast::C_BUILTIN_INT>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_UINT:
+            from_lua_array_t<ast::C_BUILTIN_UINT>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LONG:
+            from_lua_array_t<ast::C_BUILTIN_LONG>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_ULONG:
+            from_lua_array_t<ast::C_BUILTIN_ULONG>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LLONG:
+            from_lua_array_t<ast::C_BUILTIN_LLONG>(L, tp, dst, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_ULLONG:
+            from_lua_array_t<ast::C_BUILTIN_ULLONG>(L, tp, dst, tidx, sidx, n);
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+bool to_lua_array(
+    lua_State *L, ast::c_type const &tp, void const *src, int tidx, int sidx,
+    size_t n
+) {
+    if (tp.is_ref()) {
+        return false;
+    }
+    switch (tp.type()) {
+        case ast::C_BUILTIN_FLOAT:
+            to_lua_array_t<ast::C_BUILTIN_FLOAT>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_DOUBLE:
+            to_lua_array_t<ast::C_BUILTIN_DOUBLE>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LDOUBLE:
+            to_lua_array_t<ast::C_BUILTIN_LDOUBLE>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_BOOL:
+            to_lua_array_t<ast::C_BUILTIN_BOOL>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_CHAR:
+            to_lua_array_t<ast::C_BUILTIN_CHAR>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_SCHAR:
+            to_lua_array_t<ast::C_BUILTIN_SCHAR>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_UCHAR:
+            to_lua_array_t<ast::C_BUILTIN_UCHAR>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_SHORT:
+            to_lua_array_t<ast::C_BUILTIN_SHORT>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_USHORT:
+            to_lua_array_t<ast::C_BUILTIN_USHORT>(L, tp, src, tidx, sidx, n);
+            return true;
+        /* TODO: large enums */
+        case ast::C_BUILTIN_ENUM:
+        case ast::C_BUILTIN_INT:
+            to_lua_array_t<ast::C_BUILTIN_INT>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_UINT:
+            to_lua_array_t<ast::C_BUILTIN_UINT>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LONG:
+            to_lua_array_t<ast::C_BUILTIN_LONG>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_ULONG:
+            to_lua_array_t<ast::C_BUILTIN_ULONG>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_LLONG:
+            to_lua_array_t<ast::C_BUILTIN_LLONG>(L, tp, src, tidx, sidx, n);
+            return true;
+        case ast::C_BUILTIN_ULLONG:
+            to_lua_array_t<ast::C_BUILTIN_ULLONG>(L, tp, src, tidx, sidx, n);
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
 /* this can't be done in from_lua, because when from_lua is called, the
  * memory is not allocated yet... so do it here, as a special case
  */
@@ -1210,6 +2325,12 @@ static void from_lua_table(
         }
     }
 
+    /* plain tables of scalars, e.g. { 1, 2, 3 } */
+    if (tidx && from_lua_array(L, pb, val, tidx, sidx, size_t(ninit))) {
+        val += bsize * ninit;
+        goto fill_rest;
+    }
+
     for (int rinit = ninit; rinit; --rinit) {
         if ((base_array || base_struct) && lua_istable(L, -1)) {
             int ntidx = lua_gettop(L);
@@ -1226,6 +2347,7 @@ static void from_lua_table(
         val += bsize;
         lua_pop(L, 1);
     }
+fill_rest:
     if (ninit < int(nelems)) {
         /* fill possible remaining space with zeroes */
         memset(val, 0, bsize * (nelems - ninit));
@@ -1235,6 +2357,10 @@ static void from_lua_table(
 void get_global(lua_State *L, lib::c_lib const *dl, const char *sname) {
     auto &ds = ast::decl_store::get_main(L);
     auto const *decl = ds.lookup(sname);
+    if (!decl && ds.lazy_pending()) {
+        parser::resolve(L, sname);
+        decl = ds.lookup(sname);
+    }
 
     auto tp = ast::c_object_type::INVALID;
     if (decl) {
@@ -1244,12 +2370,24 @@ void get_global(lua_State *L, lib::c_lib const *dl, const char *sname) {
     switch (tp) {
         case ast::c_object_type::VARIABLE: {
             auto &var = decl->as<ast::c_variable>();
+            /* function cdata are immutable, so they can be reused for
+             * the library's lifetime; the key is the declaration itself,
+             * which lives in the main store and is never replaced, so a
+             * name that starts resolving elsewhere simply misses here
+             */
+            if (
+                (var.type().type() == ast::C_BUILTIN_FUNC) &&
+                lib::get_cached(dl, L, decl)
+            ) {
+                return;
+            }
             void *symp = lib::get_sym(dl, L, var.sym());
             if (var.type().type() == ast::C_BUILTIN_FUNC) {
                 make_cdata_func(
                     L, reinterpret_cast<void (*)()>(symp),
                     var.type().function(), false, nullptr
                 );
+                lib::set_cached(dl, L, decl);
             } else {
                 to_lua(L, var.type(), symp, RULE_RET);
             }
@@ -1271,8 +2409,12 @@ void get_global(lua_State *L, lib::c_lib const *dl, const char *sname) {
 void set_global(lua_State *L, lib::c_lib const *dl, char const *sname, int idx) {
     auto &ds = ast::decl_store::get_main(L);
     auto const *decl = ds.lookup(sname);
+    if (!decl && ds.lazy_pending()) {
+        parser::resolve(L, sname);
+        decl = ds.lookup(sname);
+    }
     if (!decl) {
-        luaL_error(L, "missing declaration for symbol '%s'", decl->name());
+        luaL_error(L, "missing declaration for symbol '%s'", sname);
         return;
     }
     if (decl->obj_type() != ast::c_object_type::VARIABLE) {
@@ -1288,7 +2430,39 @@ void set_global(lua_State *L, lib::c_lib const *dl, char const *sname, int idx)
     from_lua(L, cv.type(), symp, idx, rsz, RULE_CONV);
 }
 
-void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
+static void *arena_alloc(lua_State *L, cdata_arena &ar, size_t size) {
+    void *ret = nullptr;
+    try {
+        ret = ar.mem.alloc(size, alignof(arg_stor_t));
+    } catch (std::bad_alloc const &) {
+        /* raise the error outside of the handler */
+    }
+    if (!ret) {
+        luaL_error(L, "not enough memory");
+    }
+    return ret;
+}
+
+/* the collector does not see mapped memory, so make up for it by having it
+ * do more work, like it would for a userdata; a step runs the collector even
+ * when it was stopped, so leave it alone then
+ */
+static void mapped_gc_step(lua_State *L, size_t size) {
+#if LUA_VERSION_NUM > 501
+    if (!lua_gc(L, LUA_GCISRUNNING, 0)) {
+        return;
+    }
+#endif
+    size_t kb = std::min(
+        size >> 10, size_t(std::numeric_limits<int>::max())
+    );
+    lua_gc(L, LUA_GCSTEP, int(kb));
+}
+
+void make_cdata(
+    lua_State *L, ast::c_type const &decl, int rule, int idx,
+    cdata_arena *ar, bool uninit
+) {
     switch (decl.type()) {
         case ast::C_BUILTIN_FUNC:
             luaL_error(L, "invalid C type");
@@ -1296,6 +2470,9 @@ void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx) {
         default:
             break;
     }
+    if (ar && decl.callable()) {
+        luaL_error(L, "invalid C type");
+    }
     arg_stor_t stor{};
     void *cdp = nullptr;
     size_t rsz = 0, narr = 0;
@@ -1362,7 +2539,7 @@ newdata:
         if (cdp && iscdata(L, idx)) {
             /* special handling for closures */
             auto &fcd = tocdata<fdata>(L, idx);
-            if (fcd.decl.closure()) {
+            if (fcd.decl->closure()) {
                 cd = fcd.val.cd;
                 cdp = nullptr;
             }
@@ -1376,35 +2553,64 @@ newdata:
             tocdata<fdata>(L, -1).val.cd->fref = stor.as<int>();
         }
     } else {
-        auto &cd = newcdata(L, decl, rsz);
+        /* the storage is either a new cdata or comes from the arena; big
+         * arrays get pages of their own which the cdata points to, and
+         * those come zeroed already
+         */
+        bool isarr = (decl.type() == ast::C_BUILTIN_ARRAY);
+        size_t msz = isarr ? (rsz - sizeof(arg_stor_t)) : rsz;
+        cdata<noval> *cdv = nullptr;
+        void *vp = nullptr;
         void *dptr = nullptr;
-        size_t msz = rsz;
-        if (!cdp) {
-            memset(&cd.val, 0, rsz);
-            if (decl.type() == ast::C_BUILTIN_ARRAY) {
-                auto *bval = reinterpret_cast<unsigned char *>(&cd.val);
-                dptr = bval + sizeof(arg_stor_t);
-                *reinterpret_cast<void **>(bval) = dptr;
-                msz = rsz - sizeof(arg_stor_t);
+        if (ar) {
+            vp = arena_alloc(L, *ar, rsz);
+        } else if (isarr && (msz >= pages::MAP_MIN)) {
+            /* the cdata first, so that the mapping has an owner as soon as
+             * it exists and cannot leak when allocating raises an error
+             */
+            cdv = &newcdata(L, decl, sizeof(arg_stor_t) * 2);
+            dptr = pages::map(msz);
+            if (dptr) {
+                vp = &cdv->val;
+                *static_cast<void **>(vp) = dptr;
+                cdv->aux |= CDATA_AUX_MAPPED;
+                cdata_mapped_size(*cdv) = msz;
+                if (cdv->aux & CDATA_AUX_COUNTED) {
+                    stats_extra(L, *cdv, msz);
+                }
+                mapped_gc_step(L, msz);
             } else {
-                dptr = &cd.val;
+                /* fall back to a regular one */
+                lua_pop(L, 1);
+            }
+        }
+        if (!vp) {
+            cdv = &newcdata(L, decl, rsz);
+            vp = &cdv->val;
+        }
+        if (!cdp && !uninit && !dptr) {
+            memset(vp, 0, rsz);
+        }
+        if (isarr) {
+            if (!dptr) {
+                /* the array memory begins after the first arg_stor_t */
+                dptr = static_cast<unsigned char *>(vp) + sizeof(arg_stor_t);
             }
-        } else if (decl.type() == ast::C_BUILTIN_ARRAY) {
-            size_t esz = (rsz - sizeof(arg_stor_t)) / narr;
-            /* the base of the alloated block */
-            auto *bval = reinterpret_cast<unsigned char *>(&cd.val);
-            /* the array memory begins after the first arg_stor_t */
-            auto *val = bval + sizeof(arg_stor_t);
-            dptr = val;
             /* we can treat an array like a pointer, always */
-            *reinterpret_cast<void **>(bval) = val;
+            *static_cast<void **>(vp) = dptr;
+        } else {
+            dptr = vp;
+        }
+        if (!cdp) {
+            /* already zeroed or meant to be left alone */
+        } else if (isarr) {
+            size_t esz = msz / narr;
+            auto *val = static_cast<unsigned char *>(dptr);
             /* write initializers into the array part */
             for (size_t i = 0; i < narr; ++i) {
                 memcpy(&val[i * esz], cdp, esz);
             }
-            msz = rsz - sizeof(arg_stor_t);
         } else {
-            dptr = &cd.val;
             memcpy(dptr, cdp, rsz);
         }
         if (ninits && (
@@ -1428,13 +2634,27 @@ newdata:
                 from_lua_table(L, decl, dptr, msz, iidx, nsidx, nninit);
             }
         }
+        if (ar) {
+            /* nothing owns arena storage, so hand out a plain pointer to
+             * it; this also means no finalizers from metatypes
+             */
+            if (ar->last != &decl) {
+                auto &pb = (decl.type() == ast::C_BUILTIN_ARRAY)
+                    ? decl.ptr_base() : decl;
+                ar->last_ptr = &ast::decl_store::intern(
+                    L, ast::c_type{&pb, 0}
+                );
+                ar->last = &decl;
+            }
+            newcdata<void *>(L, *ar->last_ptr).val = dptr;
+            return;
+        }
         /* set a gc finalizer if provided in metatype */
         if (decl.type() == ast::C_BUILTIN_RECORD) {
-            int mf;
-            int mt = decl.record().metatype(mf);
-            if (mf & METATYPE_FLAG_GC) {
-                if (metatype_getfield(L, mt, "__gc")) {
-                    cd.gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            if (metatype_getfield(L, decl.record(), METATYPE_FLAG_GC)) {
+                cdv->gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                if (cdv->aux & CDATA_AUX_COUNTED) {
+                    stats_finalizer(L, 1);
                 }
             }
         }
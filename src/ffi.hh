@@ -4,13 +4,17 @@
 #include <cstddef>
 #include <limits>
 #include <type_traits>
-#include <list>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
 
 #include "libffi.hh"
 
 #include "lua.hh"
 #include "lib.hh"
 #include "ast.hh"
+#include "async.hh"
 
 namespace ffi {
 
@@ -108,6 +112,17 @@ static inline constexpr auto metafield_name(metatype_flag flag) {
     return "";
 }
 
+/* the flags are bits of an int, the handlers are indexed by the bit */
+static constexpr int METATYPE_SLOTS = 32;
+
+static inline constexpr int metafield_index(metatype_flag flag) {
+    int ret = 0;
+    for (auto f = unsigned(flag); f > 1; f >>= 1) {
+        ++ret;
+    }
+    return ret;
+}
+
 struct arg_stor_t {
     std::max_align_t pad;
 
@@ -125,23 +140,22 @@ struct arg_stor_t {
 
 struct noval {};
 
+/* the type is interned in the declaration store, so cdata only keep a
+ * pointer to it; this keeps the header small and makes creation cheap
+ */
 template<typename T>
 struct cdata {
-    ast::c_type decl;
+    ast::c_type const *decl;
     int gc_ref;
-    /* auxiliary data that can be used by different cdata
-     *
-     * vararg functions store the number of arguments they have storage
-     * prepared for here to avoid reallocating every time
-     */
+    /* auxiliary flags, see the CDATA_AUX_* values */
     int aux;
     alignas(arg_stor_t) T val;
 
     void *get_addr() {
-        if (decl.is_ref()) {
+        if (decl->is_ref()) {
             goto reft;
         }
-        switch (decl.type()) {
+        switch (decl->type()) {
             case ast::C_BUILTIN_PTR:
             case ast::C_BUILTIN_FUNC:
             case ast::C_BUILTIN_ARRAY:
@@ -157,8 +171,8 @@ struct cdata {
     }
 
     void *get_deref_addr() {
-        if (decl.is_ref()) {
-            switch (decl.type()) {
+        if (decl->is_ref()) {
+            switch (decl->type()) {
                 case ast::C_BUILTIN_PTR:
                 case ast::C_BUILTIN_FUNC:
                 case ast::C_BUILTIN_ARRAY: {
@@ -178,12 +192,11 @@ struct cdata {
 };
 
 static constexpr size_t cdata_value_base() {
-    /* can't use cdata directly for the offset, as it's not considered
-     * a standard layout type because of ast::c_type, but we don't care
-     * about that, we just want to know which offset val is at
+    /* can't use cdata directly for the offset, as it's a template, but
+     * we don't care about that, we just want to know which offset val is at
      */
     using T = struct {
-        alignas(ast::c_type) char tpad[sizeof(ast::c_type)];
+        ast::c_type const *tpad;
         int pad1, pad2;
         arg_stor_t val;
     };
@@ -191,16 +204,51 @@ static constexpr size_t cdata_value_base() {
 }
 
 struct ctype {
-    ast::c_type decl;
+    ast::c_type const *decl;
     int ct_tag;
 };
 
+/* specialized converters for callback arguments and results, picked when
+ * the closure is created; null means the generic conversion is used
+ */
+using cb_arg_f = void (*)(lua_State *L, void const *value);
+using cb_ret_f = bool (*)(lua_State *L, void *ret);
+
+/* invocations of queued callbacks made from foreign threads; they are
+ * pushed onto `head` by any thread and only ever taken off by the thread
+ * owning the state, which moves them to `pending` before running them
+ */
+struct cb_entry;
+
+struct cb_queue {
+    std::atomic<cb_entry *> head{nullptr};
+    cb_entry *pending = nullptr;
+    cb_entry *pending_last = nullptr;
+};
+
+struct fdata;
+struct closure_pool;
+
 struct closure_data {
-    std::list<closure_data **> refs{};
+    fdata *refs = nullptr; /* intrusive list of the cdata using this */
     ffi_cif cif; /* closure data needs its own cif */
     int fref = LUA_REFNIL;
-    lua_State *L = nullptr;
+    lua_State *L = nullptr; /* the thread the callback runs on */
     ffi_closure *closure = nullptr;
+    void *code = nullptr; /* executable address of the closure */
+    ast::c_function const *func = nullptr;
+    cb_ret_f rconv = nullptr;
+    closure_pool *pool = nullptr;
+    closure_data *next = nullptr; /* when cached in the pool */
+    size_t nargs = 0;
+    /* made for a lua function passed to C, see from_lua; the function is
+     * only weakly referenced and the closure goes away with its cdata
+     */
+    bool autocb = false;
+    /* set for queued callbacks */
+    cb_queue *queue = nullptr;
+    std::thread::id owner{};
+    bool qwait = true; /* foreign threads wait for the result */
 
     /* arguments data follow this struct; it's pointer aligned so it's fine */
     ffi_type **targs() {
@@ -209,24 +257,97 @@ struct closure_data {
         return u.tp;
     }
 
-    ~closure_data() {
-        if (!closure) {
-            return;
-        }
-        /* invalidate any registered references to the closure data */
-        while (!refs.empty()) {
-            *refs.front() = nullptr;
-            refs.pop_front();
+    /* argument converters follow the argument types */
+    cb_arg_f *aconvs() {
+        return reinterpret_cast<cb_arg_f *>(&targs()[nargs]);
+    }
+};
+
+/* released closures are kept around per state and handed out again to new
+ * callbacks with the same number of arguments, which is what the size of
+ * the allocation depends on; everything else is set up again on reuse, so
+ * the expensive part that gets saved is mainly the executable trampoline
+ */
+struct closure_pool {
+    static constexpr size_t MAX_ARGS = 8;
+    static constexpr size_t MAX_CACHED = 32; /* per argument count */
+
+    closure_data *free[MAX_ARGS + 1] = {};
+    size_t nfree[MAX_ARGS + 1] = {};
+    size_t live = 0; /* handed out and not yet freed */
+    size_t created = 0; /* freshly allocated */
+    size_t recycled = 0; /* taken from the cache */
+    bool closed = false; /* the state is going away, don't cache */
+
+    size_t cached() const {
+        size_t ret = 0;
+        for (auto n: nfree) {
+            ret += n;
         }
-        luaL_unref(L, LUA_REGISTRYINDEX, fref);
-        ffi_closure_free(closure);
+        return ret;
     }
+
+    /* frees the cached closures, called when the state is closed */
+    void close();
+};
+
+/* C functions used as finalizers through ffi.gc which take a pointer and
+ * return nothing; the cdata refer to them by index, so that the collector
+ * can call them directly instead of going through Lua and a full call
+ */
+struct native_gc {
+    static constexpr size_t MAX_FUNCS = 64;
+
+    void (*funcs[MAX_FUNCS])(void *) = {};
+    size_t nfuncs = 0;
+};
+
+/* gc_ref values at or below this refer to native finalizers */
+static constexpr int GC_NATIVE_BASE = -256;
+
+/* opt-in allocation accounting, see ffi.stats; the cdata made while it's
+ * on are flagged, so that only those are taken off the counts again when
+ * they are collected, no matter when the accounting was turned on or off
+ */
+struct alloc_stats {
+    struct entry {
+        size_t live = 0;
+        size_t bytes = 0;
+        size_t allocs = 0;
+    };
+
+    std::unordered_map<ast::c_type const *, entry> types{};
+    std::chrono::steady_clock::time_point since{};
+    std::chrono::steady_clock::time_point until{};
+    size_t live = 0;
+    size_t bytes = 0;
+    size_t allocs = 0; /* since it was last turned on */
+    size_t finalizers = 0; /* counted cdata with a finalizer set */
+    bool enabled = false;
+    bool closed = false; /* the state is going away */
 };
 
+/* the number of states with the accounting on; the allocation paths don't
+ * bother looking up their own state's counters while this is zero
+ */
+extern std::atomic<int> alloc_stats_users;
+
+/* accounts for a newly made cdata of the given total size */
+void stats_new(lua_State *L, cdata<noval> &cd, size_t bytes);
+
+/* for memory which belongs to a counted cdata but lives elsewhere */
+void stats_extra(lua_State *L, cdata<noval> &cd, size_t bytes);
+
+/* a finalizer was set on (1) or taken off (-1) a counted cdata */
+void stats_finalizer(lua_State *L, int diff);
+
 /* data used for function types */
 struct fdata {
     void (*sym)();
     closure_data *cd; /* only for callbacks, otherwise nullptr */
+    /* other references to the same closure, only for callbacks */
+    fdata *rprev;
+    fdata *rnext;
     ffi_cif cif;
     arg_stor_t rarg;
 
@@ -239,33 +360,42 @@ struct fdata {
 
 template<typename T>
 static inline cdata<T> &newcdata(
-    lua_State *L, ast::c_type &&tp, size_t extra = 0
+    lua_State *L, ast::c_type const &tp, size_t extra = 0
 ) {
     auto *cd = lua::newuserdata<cdata<T>>(L, extra);
-    new (&cd->decl) ast::c_type{std::move(tp)};
+    cd->decl = &ast::decl_store::intern(L, tp);
     cd->gc_ref = LUA_REFNIL;
     cd->aux = 0;
     lua::mark_cdata(L);
+    if (alloc_stats_users.load(std::memory_order_relaxed)) {
+        stats_new(
+            L, *reinterpret_cast<cdata<noval> *>(cd), sizeof(cdata<T>) + extra
+        );
+    }
     return *cd;
 }
 
-template<typename T>
-static inline cdata<T> &newcdata(
-    lua_State *L, ast::c_type const &tp, size_t extra = 0
-) {
-    return newcdata<T>(L, ast::c_type{tp}, extra);
-}
-
 static inline cdata<ffi::noval> &newcdata(
     lua_State *L, ast::c_type const &tp, size_t vals
 ) {
     auto *cd = static_cast<cdata<ffi::noval> *>(
         lua_newuserdata(L, vals + cdata_value_base())
     );
-    new (&cd->decl) ast::c_type{std::move(tp)};
+    cd->decl = &ast::decl_store::intern(L, tp);
     cd->gc_ref = LUA_REFNIL;
     cd->aux = 0;
     lua::mark_cdata(L);
+    if (alloc_stats_users.load(std::memory_order_relaxed)) {
+        stats_new(L, *cd, vals + cdata_value_base());
+    }
+    return *cd;
+}
+
+static inline ctype &newctype(lua_State *L, ast::c_type const &tp) {
+    auto *cd = lua::newuserdata<ctype>(L);
+    cd->ct_tag = lua::CFFI_CTYPE_TAG;
+    cd->decl = &ast::decl_store::intern(L, tp);
+    lua::mark_cdata(L);
     return *cd;
 }
 
@@ -273,7 +403,9 @@ template<typename ...A>
 static inline ctype &newctype(lua_State *L, A &&...args) {
     auto *cd = lua::newuserdata<ctype>(L);
     cd->ct_tag = lua::CFFI_CTYPE_TAG;
-    new (&cd->decl) ast::c_type{std::forward<A>(args)...};
+    cd->decl = &ast::decl_store::intern(
+        L, ast::c_type{std::forward<A>(args)...}
+    );
     lua::mark_cdata(L);
     return *cd;
 }
@@ -331,25 +463,103 @@ static inline cdata<T> &tocdata(lua_State *L, int idx) {
     return *lua::touserdata<ffi::cdata<T>>(L, idx);
 }
 
+/* cdata::aux flag of arrays whose memory is mapped on its own, see
+ * pages.hh; the size of the mapping follows the pointer to it
+ */
+static constexpr int CDATA_AUX_MAPPED = 1 << 0;
+
+/* cdata::aux flag of cdata included in the allocation accounting */
+static constexpr int CDATA_AUX_COUNTED = 1 << 1;
+
+/* whether the collector has something to call for the cdata */
+template<typename T>
+static inline bool cdata_has_finalizer(cdata<T> const &cd) {
+    return (cd.gc_ref >= 0) || (cd.gc_ref <= GC_NATIVE_BASE);
+}
+
+template<typename T>
+static inline size_t &cdata_mapped_size(cdata<T> &cd) {
+    auto *bval = reinterpret_cast<unsigned char *>(&cd.val);
+    return *reinterpret_cast<size_t *>(bval + sizeof(arg_stor_t));
+}
+
 /* careful with this; use only if you're sure you have cdata at the index */
 static inline size_t cdata_value_size(lua_State *L, int idx) {
     auto &cd = tocdata<void *>(L, idx);
-    if (cd.decl.vla()) {
+    if (
+        (cd.decl->type() == ast::C_BUILTIN_ARRAY) &&
+        (cd.aux & CDATA_AUX_MAPPED)
+    ) {
+        return cdata_mapped_size(cd);
+    } else if (cd.decl->vla()) {
         /* VLAs only exist on lua side, they are always allocated by us, so
          * we can be sure they are contained within the lua-allocated block
          */
         return lua_rawlen(L, idx) - cdata_value_base() - sizeof(arg_stor_t);
     } else {
         /* otherwise the size is known, so fall back to that */
-        return cd.decl.alloc_size();
+        return cd.decl->alloc_size();
     }
 }
 
 void destroy_cdata(lua_State *L, cdata<ffi::noval> &cd);
-void destroy_closure(closure_data *cd);
+
+/* sets the function at `idx` as a native finalizer of `cd` if it can be
+ * one, i.e. it is a C function taking a pointer `cd` converts to and
+ * returning nothing; returns false otherwise
+ */
+bool set_native_gc(lua_State *L, cdata<ffi::noval> &cd, int idx);
+
+/* invalidates all references to the closure and gives it back to the pool
+ * of the state, or frees it when the pool has enough of the kind; the given
+ * state may be any thread of the one the closure was made in
+ */
+void destroy_closure(lua_State *L, closure_data *cd);
+
+/* makes calls of the callback from threads other than the current one go
+ * through the queue of the state; `wait` means the calling thread blocks
+ * until the call has been dispatched, otherwise it gets a zero result
+ */
+void queue_closure(lua_State *L, closure_data &cd, bool wait);
+
+/* runs up to `max` (0 for no limit) queued callback invocations on `L`
+ * and returns how many were run; must be called on the owning thread
+ */
+size_t dispatch_queued(lua_State *L, cb_queue &q, size_t max);
+
+/* drops the queued invocations of `cd`, or all of them if null; waiting
+ * threads are released with a zero result
+ */
+void purge_queued(cb_queue &q, closure_data const *cd);
 
 int call_cif(cdata<fdata> &fud, lua_State *L, size_t largs);
 
+/* a call running on the worker pool; the function and the arguments are
+ * anchored in the registry (`ref`) until the handle is collected
+ */
+struct async_handle {
+    async::call call;
+    ast::c_function const *func = nullptr;
+    int ref = LUA_REFNIL;
+    bool submitted = false;
+
+    /* storage for the result follows, then argument values, copies of
+     * records passed by value and pointers to the values; the result is
+     * big enough for any return type
+     */
+    arg_stor_t *stor() {
+        union { arg_stor_t *av; async_handle *ah; } u;
+        u.ah = this + 1;
+        return u.av;
+    }
+};
+
+/* converts the arguments like call_cif, then submits the call and pushes
+ * a handle for it; result conversion happens in async_result
+ */
+void async_cif(cdata<fdata> &fud, lua_State *L, size_t largs);
+int async_result(lua_State *L, async_handle &ah);
+
 enum conv_rule {
     RULE_CONV = 0,
     RULE_PASS,
@@ -381,27 +591,49 @@ void *from_lua(
     size_t &dsz, int rule
 );
 
+/* bulk versions of the above for arrays of `n` arithmetic values of type
+ * `tp`, with the Lua side being a table at `tidx` starting with index `sidx`
+ *
+ * they return false without doing anything when `tp` is not arithmetic
+ */
+bool from_lua_array(
+    lua_State *L, ast::c_type const &tp, void *dst, int tidx, int sidx,
+    size_t n
+);
+bool to_lua_array(
+    lua_State *L, ast::c_type const &tp, void const *src, int tidx, int sidx,
+    size_t n
+);
+
 void get_global(lua_State *L, lib::c_lib const *dl, const char *sname);
 void set_global(lua_State *L, lib::c_lib const *dl, char const *sname, int idx);
 
-void make_cdata(lua_State *L, ast::c_type const &decl, int rule, int idx);
-
-static inline bool metatype_getfield(lua_State *L, int mt, char const *fname) {
-    luaL_getmetatable(L, lua::CFFI_CDATA_MT);
-    lua_getfield(L, -1, "__ffi_metatypes");
-    lua_rawgeti(L, -1, mt);
-    if (lua_istable(L, -1)) {
-        lua_getfield(L, -1, fname);
-        if (!lua_isnil(L, -1)) {
-            lua_insert(L, -4);
-            lua_pop(L, 3);
-            return true;
-        } else {
-            lua_pop(L, 1);
-        }
+/* storage for cdata which goes away all at once, see ffi.arena */
+struct cdata_arena {
+    util::arena mem{};
+    /* the pointer type handed out for the last type allocated */
+    ast::c_type const *last = nullptr;
+    ast::c_type const *last_ptr = nullptr;
+};
+
+/* with an arena, the storage is allocated from it and what gets pushed is
+ * a pointer to it (to the first element for arrays); uninitialized storage
+ * is not cleared, which only makes sense without initializers
+ */
+void make_cdata(
+    lua_State *L, ast::c_type const &decl, int rule, int idx,
+    cdata_arena *ar = nullptr, bool uninit = false
+);
+
+/* pushes the handler and returns true if the record has the metamethod */
+static inline bool metatype_getfield(
+    lua_State *L, ast::c_record const &rec, metatype_flag flag
+) {
+    if (!(rec.metaflags() & flag)) {
+        return false;
     }
-    lua_pop(L, 3);
-    return false;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, rec.metahandler(metafield_index(flag)));
+    return true;
 }
 
 template<typename T>
@@ -462,8 +694,8 @@ static inline bool test_arith(lua_State *L, int idx, T &out) {
         }
         return true;
     };
-    int tp = cd->decl.type();
-    if (cd->decl.is_ref()) {
+    int tp = cd->decl->type();
+    if (cd->decl->is_ref()) {
         if (gf(tp, *cd->val.as<arg_stor_t *>(), out)) {
             return true;
         }
@@ -627,8 +859,8 @@ static inline ast::c_expr_type check_arith_expr(
         }
     };
     ast::c_expr_type ret;
-    int tp = cd->decl.type();
-    if (cd->decl.is_ref()) {
+    int tp = cd->decl->type();
+    if (cd->decl->is_ref()) {
         ret = gf(tp, *cd->val.as<arg_stor_t *>(), iv);
     } else {
         ret = gf(tp, cd->val, iv);
@@ -657,7 +889,7 @@ static inline cdata<arg_stor_t> &make_cdata_arith(
 static inline std::string lua_serialize(lua_State *L, int idx) {
     auto *cd = testcdata<noval>(L, idx);
     if (cd) {
-        return cd->decl.serialize();
+        return cd->decl->serialize();
     }
     return lua_typename(L, lua_type(L, idx));
 }
@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
 
 #include "platform.hh"
 #include "parser.hh"
@@ -8,6 +9,7 @@
 #include "lib.hh"
 #include "lua.hh"
 #include "ffi.hh"
+#include "pool.hh"
 
 /* sets up the metatable for library, i.e. the individual namespaces
  * of loaded shared libraries as well as the primary C namespace.
@@ -65,6 +67,321 @@ struct lib_meta {
     }
 };
 
+/* handles of calls running on the worker pool */
+struct async_meta {
+    static ffi::async_handle &check(lua_State *L) {
+        return *static_cast<ffi::async_handle *>(
+            luaL_checkudata(L, 1, lua::CFFI_ASYNC_MT)
+        );
+    }
+
+    static int gc(lua_State *L) {
+        auto &ah = check(L);
+        /* the worker may still be writing into the handle */
+        if (ah.submitted) {
+            async::wait(ah.call);
+            ah.submitted = false;
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, ah.ref);
+        ah.ref = LUA_REFNIL;
+        return 0;
+    }
+
+    static int tostring(lua_State *L) {
+        lua_pushfstring(L, "async: %p", static_cast<void *>(&check(L)));
+        return 1;
+    }
+
+    static int done(lua_State *L) {
+        lua_pushboolean(L, async::done(check(L).call));
+        return 1;
+    }
+
+    static int wait(lua_State *L) {
+        return ffi::async_result(L, check(L));
+    }
+
+    static void setup(lua_State *L) {
+        if (!luaL_newmetatable(L, lua::CFFI_ASYNC_MT)) {
+            luaL_error(L, "unexpected error: registry reinitialized");
+        }
+
+        lua_pushliteral(L, "ffi");
+        lua_setfield(L, -2, "__metatable");
+
+        lua_pushcfunction(L, gc);
+        lua_setfield(L, -2, "__gc");
+
+        lua_pushcfunction(L, tostring);
+        lua_setfield(L, -2, "__tostring");
+
+        lua_createtable(L, 0, 2);
+        lua_pushcfunction(L, done);
+        lua_setfield(L, -2, "done");
+        lua_pushcfunction(L, wait);
+        lua_setfield(L, -2, "wait");
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+};
+
+/* arenas for cdata storage that goes away all at once */
+struct arena_meta {
+    static ffi::cdata_arena &check(lua_State *L) {
+        return *static_cast<ffi::cdata_arena *>(
+            luaL_checkudata(L, 1, lua::CFFI_ARENA_MT)
+        );
+    }
+
+    static int gc(lua_State *L) {
+        check(L).~cdata_arena();
+        return 0;
+    }
+
+    static int tostring(lua_State *L) {
+        lua_pushfstring(L, "arena: %p", static_cast<void *>(&check(L)));
+        return 1;
+    }
+
+    static int new_f(lua_State *L);
+
+    static int reset(lua_State *L) {
+        check(L).mem.reset();
+        return 0;
+    }
+
+    static int stats(lua_State *L) {
+        auto st = check(L).mem.get_stats();
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, lua_Integer(st.used));
+        lua_setfield(L, -2, "used");
+        lua_pushinteger(L, lua_Integer(st.size));
+        lua_setfield(L, -2, "size");
+        lua_pushinteger(L, lua_Integer(st.chunks));
+        lua_setfield(L, -2, "chunks");
+        return 1;
+    }
+
+    static void setup(lua_State *L) {
+        if (!luaL_newmetatable(L, lua::CFFI_ARENA_MT)) {
+            luaL_error(L, "unexpected error: registry reinitialized");
+        }
+
+        lua_pushliteral(L, "ffi");
+        lua_setfield(L, -2, "__metatable");
+
+        lua_pushcfunction(L, gc);
+        lua_setfield(L, -2, "__gc");
+
+        lua_pushcfunction(L, tostring);
+        lua_setfield(L, -2, "__tostring");
+
+        lua_createtable(L, 0, 3);
+        lua_pushcfunction(L, new_f);
+        lua_setfield(L, -2, "new");
+        lua_pushcfunction(L, reset);
+        lua_setfield(L, -2, "reset");
+        lua_pushcfunction(L, stats);
+        lua_setfield(L, -2, "stats");
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+};
+
+/* a path of members and array elements resolved against a record type up
+ * front; reading or writing through it is then a single offset away from
+ * the object, without any lookups or intermediate reference cdata
+ */
+struct field_meta {
+    struct accessor {
+        ast::c_type const *root;
+        ast::c_type const *type;
+        size_t offset;
+    };
+
+    static accessor &check(lua_State *L) {
+        return *static_cast<accessor *>(
+            luaL_checkudata(L, 1, lua::CFFI_FIELD_MT)
+        );
+    }
+
+    static bool is_name_char(char c, bool first) {
+        if ((c >= 'a') && (c <= 'z')) {
+            return true;
+        }
+        if (((c >= 'A') && (c <= 'Z')) || (c == '_')) {
+            return true;
+        }
+        return !first && (c >= '0') && (c <= '9');
+    }
+
+    /* the serialized name must be gone before the error unwinds */
+    static void fail(
+        lua_State *L, char const *fmt, ast::c_type const &tp,
+        char const *mname = nullptr
+    ) {
+        luaL_where(L, 1);
+        {
+            auto s = tp.serialize();
+            lua_pushfstring(L, fmt, s.c_str(), mname);
+        }
+        lua_concat(L, 2);
+        lua_error(L);
+    }
+
+    /* pushes the accessor for the path; the syntax is a member name
+     * followed by any number of '.name' and '[index]'
+     */
+    static void compile(lua_State *L, ast::c_type const &ct, char const *path) {
+        if (ct.type() != ast::C_BUILTIN_RECORD) {
+            fail(L, "'%s' is not a struct or union", ct);
+        }
+        if (ct.record().opaque()) {
+            fail(L, "attempt to use an incomplete type '%s'", ct);
+        }
+        ast::c_type const *tp = &ct;
+        size_t off = 0;
+        char const *p = path;
+        for (bool first = true; *p || first; first = false) {
+            if (*p == '[') {
+                char *end = nullptr;
+                unsigned long long idx = 0;
+                if ((p[1] >= '0') && (p[1] <= '9')) {
+                    idx = strtoull(p + 1, &end, 10);
+                }
+                if (!end || (*end != ']')) {
+                    luaL_error(L, "invalid field path '%s'", path);
+                }
+                if (tp->type() != ast::C_BUILTIN_ARRAY) {
+                    fail(L, "'%s' is not an array", *tp);
+                }
+                if (
+                    !tp->vla() && !tp->unbounded() &&
+                    (idx >= tp->array_size())
+                ) {
+                    fail(L, "index out of bounds for '%s'", *tp);
+                }
+                tp = &tp->ptr_base();
+                off += size_t(idx) * tp->alloc_size();
+                p = end + 1;
+                continue;
+            }
+            if (!first) {
+                if (*p != '.') {
+                    luaL_error(L, "invalid field path '%s'", path);
+                }
+                ++p;
+            }
+            char const *name = p;
+            while (is_name_char(*p, p == name)) {
+                ++p;
+            }
+            if (p == name) {
+                luaL_error(L, "invalid field path '%s'", path);
+            }
+            if (tp->type() != ast::C_BUILTIN_RECORD) {
+                /* pointers would have to be followed at access time */
+                fail(L, "'%s' is not a struct or union", *tp);
+            }
+            lua_pushlstring(L, name, size_t(p - name));
+            ast::c_type const *ftp;
+            auto foff = tp->record().field_offset(lua_tostring(L, -1), ftp);
+            if (foff < 0) {
+                fail(
+                    L, "'%s' has no member named '%s'", *tp,
+                    lua_tostring(L, -1)
+                );
+            }
+            lua_pop(L, 1);
+            tp = ftp;
+            off += size_t(foff);
+        }
+        auto *acc = lua::newuserdata<accessor>(L);
+        acc->root = &ast::decl_store::intern(L, ct);
+        acc->type = &ast::decl_store::intern(L, *tp);
+        acc->offset = off;
+        luaL_setmetatable(L, lua::CFFI_FIELD_MT);
+    }
+
+    /* the object may be the record itself, a reference or a pointer to it */
+    static unsigned char *object_addr(lua_State *L, accessor const &acc) {
+        auto &cd = ffi::checkcdata<void *>(L, 2);
+        void **valp = &cd.val;
+        auto const *decl = cd.decl;
+        if (decl->is_ref()) {
+            valp = reinterpret_cast<void **>(*valp);
+        }
+        if (decl->type() == ast::C_BUILTIN_PTR) {
+            decl = &decl->ptr_base();
+            valp = reinterpret_cast<void **>(*valp);
+        }
+        if (
+            (decl->type() != ast::C_BUILTIN_RECORD) ||
+            (&decl->record() != &acc.root->record())
+        ) {
+            {
+                auto fs = cd.decl->serialize();
+                auto ts = acc.root->serialize();
+                lua_pushfstring(
+                    L, "'%s' is not '%s' or a pointer to it",
+                    fs.c_str(), ts.c_str()
+                );
+            }
+            luaL_argcheck(L, false, 2, lua_tostring(L, -1));
+        }
+        return reinterpret_cast<unsigned char *>(valp) + acc.offset;
+    }
+
+    static int get(lua_State *L) {
+        auto &acc = check(L);
+        void *val = object_addr(L, acc);
+        void *pp = val;
+        if (acc.type->type() == ast::C_BUILTIN_ARRAY) {
+            pp = &val;
+        }
+        if (!ffi::to_lua(L, *acc.type, pp, ffi::RULE_CONV)) {
+            luaL_error(L, "invalid C type");
+        }
+        return 1;
+    }
+
+    static int set(lua_State *L) {
+        auto &acc = check(L);
+        void *val = object_addr(L, acc);
+        size_t rsz;
+        ffi::from_lua(L, *acc.type, val, 3, rsz, ffi::RULE_CONV);
+        return 0;
+    }
+
+    static int tostring(lua_State *L) {
+        lua_pushfstring(L, "field: %p", static_cast<void *>(&check(L)));
+        return 1;
+    }
+
+    static void setup(lua_State *L) {
+        if (!luaL_newmetatable(L, lua::CFFI_FIELD_MT)) {
+            luaL_error(L, "unexpected error: registry reinitialized");
+        }
+
+        lua_pushliteral(L, "ffi");
+        lua_setfield(L, -2, "__metatable");
+
+        lua_pushcfunction(L, tostring);
+        lua_setfield(L, -2, "__tostring");
+
+        lua_createtable(L, 0, 2);
+        lua_pushcfunction(L, get);
+        lua_setfield(L, -2, "get");
+        lua_pushcfunction(L, set);
+        lua_setfield(L, -2, "set");
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+};
+
 /* used by all kinds of cdata
  *
  * there are several kinds of cdata:
@@ -78,29 +395,28 @@ struct cdata_meta {
         return 0;
     }
 
-    static int metatype_getmt(lua_State *L, int idx, int &mflags) {
+    static ast::c_record const *metatype_getrec(lua_State *L, int idx) {
         auto &cd = ffi::tocdata<ffi::noval>(L, idx);
-        auto *decl = &cd.decl;
+        auto *decl = cd.decl;
         auto tp = decl->type();
         if (tp == ast::C_BUILTIN_RECORD) {
-            return cd.decl.record().metatype(mflags);
+            return &decl->record();
         } else if (tp == ast::C_BUILTIN_PTR) {
-            if (cd.decl.ptr_base().type() != ast::C_BUILTIN_RECORD) {
-                return LUA_REFNIL;
+            if (decl->ptr_base().type() != ast::C_BUILTIN_RECORD) {
+                return nullptr;
             }
-            return cd.decl.ptr_base().record().metatype(mflags);
+            return &decl->ptr_base().record();
         }
-        return LUA_REFNIL;
+        return nullptr;
     }
 
     template<ffi::metatype_flag flag>
     static inline bool metatype_check(lua_State *L, int idx) {
-        int mflags = 0;
-        int mtp = metatype_getmt(L, idx, mflags);
-        if (!(mflags & flag)) {
+        auto *rec = metatype_getrec(L, idx);
+        if (!rec) {
             return false;
         }
-        return ffi::metatype_getfield(L, mtp, ffi::metafield_name(flag));
+        return ffi::metatype_getfield(L, *rec, flag);
     }
 
     static int tostring(lua_State *L) {
@@ -122,7 +438,7 @@ struct cdata_meta {
                 lua_pop(L, 1);
             }
 #endif
-            lua_pushfstring(L, "ctype<%s>", cd.decl.serialize().c_str());
+            lua_pushfstring(L, "ctype<%s>", cd.decl->serialize().c_str());
             return 1;
         }
 #if LUA_VERSION_NUM > 502
@@ -135,7 +451,7 @@ struct cdata_meta {
             lua_pop(L, 1);
         }
 #endif
-        auto const *tp = &cd.decl;
+        auto const *tp = cd.decl;
         ffi::arg_stor_t const *val = &cd.val;
         if (tp->is_ref()) {
             val = cd.val.as<ffi::arg_stor_t const *>();
@@ -157,7 +473,7 @@ struct cdata_meta {
             lua_pushlstring(L, buf, written);
             return 1;
         }
-        auto s = cd.decl.serialize();
+        auto s = cd.decl->serialize();
         lua_pushfstring(L, "cdata<%s>: %p", s.c_str(), cd.get_addr());
         return 1;
     }
@@ -170,21 +486,21 @@ struct cdata_meta {
                 lua_insert(L, 1);
                 lua_call(L, nargs, 1);
             } else {
-                ffi::make_cdata(L, fd.decl, ffi::RULE_CONV, 2);
+                ffi::make_cdata(L, *fd.decl, ffi::RULE_CONV, 2);
             }
             return 1;
         }
-        if (!fd.decl.callable()) {
+        if (!fd.decl->callable()) {
             int nargs = lua_gettop(L);
             if (metatype_check<ffi::METATYPE_FLAG_CALL>(L, 1)) {
                 lua_insert(L, 1);
                 lua_call(L, nargs, LUA_MULTRET);
                 return lua_gettop(L);
             }
-            auto s = fd.decl.serialize();
+            auto s = fd.decl->serialize();
             luaL_error(L, "'%s' is not callable", s.c_str());
         }
-        if (fd.decl.closure() && !fd.val.cd) {
+        if (fd.decl->closure() && !fd.val.cd) {
             luaL_error(L, "bad callback");
         }
         return ffi::call_cif(fd, L, lua_gettop(L) - 1);
@@ -197,7 +513,7 @@ struct cdata_meta {
             luaL_error(L, "'ctype' is not indexable");
         }
         void **valp = &cd.val;
-        auto const *decl = &cd.decl;
+        auto const *decl = cd.decl;
         if (decl->is_ref()) {
             valp = reinterpret_cast<void **>(*valp);
         }
@@ -250,17 +566,17 @@ struct cdata_meta {
 
     static int cb_free(lua_State *L) {
         auto &cd = ffi::checkcdata<ffi::fdata>(L, 1);
-        luaL_argcheck(L, cd.decl.closure(), 1, "not a callback");
+        luaL_argcheck(L, cd.decl->closure(), 1, "not a callback");
         if (!cd.val.cd) {
             luaL_error(L, "bad callback");
         }
-        ffi::destroy_closure(cd.val.cd);
+        ffi::destroy_closure(L, cd.val.cd);
         return 0;
     }
 
     static int cb_set(lua_State *L) {
         auto &cd = ffi::checkcdata<ffi::fdata>(L, 1);
-        luaL_argcheck(L, cd.decl.closure(), 1, "not a callback");
+        luaL_argcheck(L, cd.decl->closure(), 1, "not a callback");
         if (!cd.val.cd) {
             luaL_error(L, "bad callback");
         }
@@ -273,9 +589,20 @@ struct cdata_meta {
         return 0;
     }
 
+    static int cb_queue(lua_State *L) {
+        auto &cd = ffi::checkcdata<ffi::fdata>(L, 1);
+        luaL_argcheck(L, cd.decl->closure(), 1, "not a callback");
+        if (!cd.val.cd) {
+            luaL_error(L, "bad callback");
+        }
+        bool wait = lua_isnone(L, 2) || lua_toboolean(L, 2);
+        ffi::queue_closure(L, *cd.val.cd, wait);
+        return 0;
+    }
+
     static int index(lua_State *L) {
         auto &cd = ffi::tocdata<ffi::noval>(L, 1);
-        if (cd.decl.closure()) {
+        if (cd.decl->closure()) {
             /* callbacks have some methods */
             char const *mname = lua_tostring(L, 2);
             /* if we had more methods, we'd do a table */
@@ -285,16 +612,19 @@ struct cdata_meta {
             } else if (!strcmp(mname, "set")) {
                 lua_pushcfunction(L, cb_set);
                 return 1;
+            } else if (!strcmp(mname, "queue")) {
+                lua_pushcfunction(L, cb_queue);
+                return 1;
             } else if (!mname) {
                 luaL_error(
                     L, "'%s' cannot be indexed with '%s'",
-                    cd.decl.serialize().c_str(),
+                    cd.decl->serialize().c_str(),
                     lua_typename(L, lua_type(L, 2))
                 );
             } else {
                 luaL_error(
                     L, "'%s' has no member named '%s'",
-                    cd.decl.serialize().c_str(), mname
+                    cd.decl->serialize().c_str(), mname
                 );
             }
             return 0;
@@ -328,12 +658,12 @@ struct cdata_meta {
         if (lua_type(L, 2) != LUA_TSTRING) {
             luaL_error(
                 L, "'%s' is not indexable with '%s'",
-                cd.decl.serialize().c_str(), lua_typename(L, 2)
+                cd.decl->serialize().c_str(), lua_typename(L, 2)
             );
         } else {
             luaL_error(
                 L, "'%s' has no member named '%s'",
-                cd.decl.serialize().c_str(), lua_tostring(L, 2)
+                cd.decl->serialize().c_str(), lua_tostring(L, 2)
             );
         }
         return 1;
@@ -353,7 +683,7 @@ struct cdata_meta {
         }
         luaL_error(
             L, "'%s' has no member named '%s'",
-            ffi::tocdata<ffi::noval>(L, 1).decl.serialize().c_str(),
+            ffi::tocdata<ffi::noval>(L, 1).decl->serialize().c_str(),
             lua_tostring(L, 2)
         );
         return 0;
@@ -366,6 +696,8 @@ struct cdata_meta {
         /* custom metatypes, either operand */
         if (cd && metatype_check<mtype>(L, 1)) {
             lua_insert(L, 1);
+            /* unary metamethods may get the operand twice since 5.3 */
+            lua_settop(L, 2);
             lua_call(L, 1, rvals);
             return true;
         }
@@ -520,8 +852,8 @@ struct cdata_meta {
         auto *cd1 = ffi::testcdata<void *>(L, 1);
         auto *cd2 = ffi::testcdata<void *>(L, 2);
         /* pointer arithmetic */
-        if (cd1 && cd1->decl.ptr_like()) {
-            size_t asize = cd1->decl.ptr_base().alloc_size();
+        if (cd1 && cd1->decl->ptr_like()) {
+            size_t asize = cd1->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (binop_try_mt<ffi::METATYPE_FLAG_ADD>(L, cd1, cd2)) {
                     return 1;
@@ -537,12 +869,12 @@ struct cdata_meta {
             }
             auto *p = static_cast<unsigned char *>(cd1->val);
             auto &ret = ffi::newcdata<void *>(
-                L, cd1->decl.as_type(ast::C_BUILTIN_PTR)
+                L, cd1->decl->as_type(ast::C_BUILTIN_PTR)
             );
             ret.val = p + d * asize;
             return 1;
-        } else if (cd2 && cd2->decl.ptr_like()) {
-            size_t asize = cd2->decl.ptr_base().alloc_size();
+        } else if (cd2 && cd2->decl->ptr_like()) {
+            size_t asize = cd2->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (binop_try_mt<ffi::METATYPE_FLAG_ADD>(L, cd1, cd2)) {
                     return 1;
@@ -558,7 +890,7 @@ struct cdata_meta {
             }
             auto *p = static_cast<unsigned char *>(cd2->val);
             auto &ret = ffi::newcdata<void *>(
-                L, cd2->decl.as_type(ast::C_BUILTIN_PTR)
+                L, cd2->decl->as_type(ast::C_BUILTIN_PTR)
             );
             ret.val = d * asize + p;
             return 1;
@@ -574,23 +906,24 @@ struct cdata_meta {
         auto *cd1 = ffi::testcdata<void *>(L, 1);
         auto *cd2 = ffi::testcdata<void *>(L, 2);
         /* pointer difference */
-        if (cd1 && cd1->decl.ptr_like()) {
-            size_t asize = cd1->decl.ptr_base().alloc_size();
+        if (cd1 && cd1->decl->ptr_like()) {
+            size_t asize = cd1->decl->ptr_base().alloc_size();
             if (!asize) {
                 if (binop_try_mt<ffi::METATYPE_FLAG_SUB>(L, cd1, cd2)) {
                     return 1;
                 }
                 luaL_error(L, "unknown C type size");
             }
-            if (cd2 && cd2->decl.ptr_like()) {
-                if (!cd1->decl.ptr_base().is_same(cd2->decl.ptr_base(), true)) {
+            if (cd2 && cd2->decl->ptr_like()) {
+                auto &pb1 = cd1->decl->ptr_base();
+                if (!pb1.is_same(cd2->decl->ptr_base(), true)) {
                     if (binop_try_mt<ffi::METATYPE_FLAG_SUB>(L, cd1, cd2)) {
                         return 1;
                     }
                     luaL_error(
                         L, "cannot convert '%s' to '%s'",
-                        cd2->decl.serialize().c_str(),
-                        cd1->decl.serialize().c_str()
+                        cd2->decl->serialize().c_str(),
+                        cd1->decl->serialize().c_str()
                     );
                 }
                 auto ret = reinterpret_cast<unsigned char *>(cd1->val)
@@ -606,7 +939,7 @@ struct cdata_meta {
                 ffi::check_arith<ptrdiff_t>(L, 2);
             }
             auto *p = static_cast<unsigned char *>(cd1->val);
-            auto &ret = ffi::newcdata<void *>(L, cd1->decl);
+            auto &ret = ffi::newcdata<void *>(L, *cd1->decl);
             ret.val = p + d;
             return 1;
         }
@@ -709,12 +1042,12 @@ struct cdata_meta {
                 /* ctype against cdata */
                 lua_pushboolean(L, false);
             } else {
-                lua_pushboolean(L, cd1->decl.is_same(cd2->decl));
+                lua_pushboolean(L, cd1->decl->is_same(*cd2->decl));
             }
             return 1;
         }
-        if (!cd1->decl.arith() || !cd2->decl.arith()) {
-            if (cd1->decl.ptr_like() && cd2->decl.ptr_like()) {
+        if (!cd1->decl->arith() || !cd2->decl->arith()) {
+            if (cd1->decl->ptr_like() && cd2->decl->ptr_like()) {
                 lua_pushboolean(
                     L, cd1->get_deref_addr() == cd2->get_deref_addr()
                 );
@@ -742,7 +1075,7 @@ struct cdata_meta {
     ) {
         if (!cd1 || !cd2) {
             auto *ccd = (cd1 ? cd1 : cd2);
-            if (!ccd->decl.arith() || !lua_isnumber(L, 2 - !cd1)) {
+            if (!ccd->decl->arith() || !lua_isnumber(L, 2 - !cd1)) {
                 if (binop_try_mt<mf1>(L, cd1, cd2)) {
                     return true;
                 } else if ((mf2 != mf1) && binop_try_mt<mf2>(L, cd2, cd1)) {
@@ -758,16 +1091,16 @@ struct cdata_meta {
             arith_64bit_cmp(L, op);
             return true;
         }
-        if (cd1->decl.arith() && cd2->decl.arith()) {
+        if (cd1->decl->arith() && cd2->decl->arith()) {
             /* compare values if both are arithmetic types */
             arith_64bit_cmp(L, op);
             return true;
         }
         /* compare only compatible pointers */
         if ((
-            (cd1->decl.type() != ast::C_BUILTIN_PTR) ||
-            (cd2->decl.type() != ast::C_BUILTIN_PTR)
-        ) || (!cd1->decl.ptr_base().is_same(cd2->decl.ptr_base(), true))) {
+            (cd1->decl->type() != ast::C_BUILTIN_PTR) ||
+            (cd2->decl->type() != ast::C_BUILTIN_PTR)
+        ) || (!cd1->decl->ptr_base().is_same(cd2->decl->ptr_base(), true))) {
             if (binop_try_mt<mf1>(L, cd1, cd2)) {
                 return true;
             } else if ((mf2 != mf1) && binop_try_mt<mf2>(L, cd2, cd1)) {
@@ -1015,10 +1348,85 @@ struct cdata_meta {
 /* the ffi module itself */
 struct ffi_module {
     static int cdef_f(lua_State *L) {
-        parser::parse(L, luaL_checkstring(L, 1), (lua_gettop(L) > 1) ? 2 : -1);
+        /* no temporaries, errors don't unwind */
+        size_t len;
+        char const *str = luaL_checklstring(L, 1, &len);
+        parser::parse(L, str, str + len, (lua_gettop(L) > 1) ? 2 : -1);
+        return 0;
+    }
+
+    static int cdef_lazy_f(lua_State *L) {
+        size_t len;
+        char const *str = luaL_checklstring(L, 1, &len);
+        parser::parse_lazy(L, str, str + len);
         return 0;
     }
 
+    /* parsed type strings are cached, so that passing the same string
+     * repeatedly is about as cheap as passing a ctype; anything committed
+     * into the declaration store may change what a string means, so the
+     * cache is thrown away whenever the store's generation changes
+     */
+    static constexpr std::size_t CT_CACHE_MAX = 256;
+
+    struct ct_cache {
+        std::size_t gen;
+        std::size_t count;
+        int ref;
+    };
+
+    static ct_cache &get_ct_cache(lua_State *L) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CT_CACHE);
+        auto *cc = lua::touserdata<ct_cache>(L, -1);
+        assert(cc);
+        lua_pop(L, 1);
+        return *cc;
+    }
+
+    static void reset_ct_cache(lua_State *L, ct_cache &cc, std::size_t gen) {
+        lua_newtable(L);
+        lua_rawseti(L, LUA_REGISTRYINDEX, cc.ref);
+        cc.gen = gen;
+        cc.count = 0;
+    }
+
+    static ast::c_type const &parse_ct(lua_State *L, int idx) {
+        auto &ds = ast::decl_store::get_main(L);
+        auto &cc = get_ct_cache(L);
+        if (cc.gen != ds.generation()) {
+            reset_ct_cache(L, cc, ds.generation());
+        }
+        luaL_checkstring(L, idx);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cc.ref);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        /* stack: cache, ctype|nil */
+        if (!lua_isnil(L, -1)) {
+            auto &ct = ffi::tocdata<ffi::noval>(L, -1);
+            lua_replace(L, idx);
+            lua_pop(L, 1);
+            return *ct.decl;
+        }
+        lua_pop(L, 2);
+        auto &ct = ffi::newctype(
+            L, parser::parse_type(L, lua_tostring(L, idx))
+        );
+        /* parsing may have committed new declarations (e.g. a previously
+         * unseen struct), the result is still valid afterwards though
+         */
+        if ((cc.gen != ds.generation()) || (cc.count >= CT_CACHE_MAX)) {
+            reset_ct_cache(L, cc, ds.generation());
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cc.ref);
+        lua_pushvalue(L, idx);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+        ++cc.count;
+        lua_replace(L, idx);
+        return *ct.decl;
+    }
+
     /* either gets a ctype or makes a ctype from a string */
     static ast::c_type const &check_ct(
         lua_State *L, int idx, int paridx = -1
@@ -1026,17 +1434,21 @@ struct ffi_module {
         if (ffi::iscval(L, idx)) {
             auto &cd = ffi::tocdata<ffi::noval>(L, idx);
             if (ffi::isctype(cd)) {
-                return cd.decl;
+                return *cd.decl;
             }
-            auto &ct = ffi::newctype(L, cd.decl);
+            auto &ct = ffi::newctype(L, *cd.decl);
             lua_replace(L, idx);
-            return ct.decl;
+            return *ct.decl;
+        }
+        /* parameterized types depend on the arguments, never cache those */
+        if (paridx < 0) {
+            return parse_ct(L, idx);
         }
         auto &ct = ffi::newctype(
             L, parser::parse_type(L, luaL_checkstring(L, idx), paridx)
         );
         lua_replace(L, idx);
-        return ct.decl;
+        return *ct.decl;
     }
 
     static int new_f(lua_State *L) {
@@ -1044,6 +1456,22 @@ struct ffi_module {
         return 1;
     }
 
+    static int new_uninit_f(lua_State *L) {
+        auto &ct = check_ct(L, 1);
+        /* only the size of variable length types can be given */
+        int nargs = 1;
+        if (ct.vla() || (
+            (ct.type() == ast::C_BUILTIN_RECORD) && ct.record().flexible()
+        )) {
+            nargs = 2;
+        }
+        if (lua_gettop(L) > nargs) {
+            luaL_error(L, "too many initializers");
+        }
+        ffi::make_cdata(L, ct, ffi::RULE_CONV, 2, nullptr, true);
+        return 1;
+    }
+
     static int cast_f(lua_State *L) {
         luaL_checkany(L, 2);
         ffi::make_cdata(L, check_ct(L, 1), ffi::RULE_CAST, 2);
@@ -1062,51 +1490,59 @@ struct ffi_module {
         }
         luaL_checktype(L, 2, LUA_TTABLE);
 
-#define FIELD_CHECK(fname, flagn) { \
-            lua_getfield(L, 2, "__" fname); \
+        /* resolve the handlers now, so that dispatch does not have to */
+        int refs[ffi::METATYPE_SLOTS] = {};
+
+#define FIELD_CHECK(flagn) { \
+            lua_getfield( \
+                L, 2, ffi::metafield_name(ffi::METATYPE_FLAG_##flagn) \
+            ); \
             if (!lua_isnil(L, -1)) { \
                 mflags |= ffi::METATYPE_FLAG_##flagn; \
+                refs[ffi::metafield_index(ffi::METATYPE_FLAG_##flagn)] = \
+                    luaL_ref(L, LUA_REGISTRYINDEX); \
+            } else { \
+                lua_pop(L, 1); \
             } \
-            lua_pop(L, 1); \
-        }
-
-        FIELD_CHECK("add", ADD)
-        FIELD_CHECK("sub", SUB)
-        FIELD_CHECK("mul", MUL)
-        FIELD_CHECK("div", DIV)
-        FIELD_CHECK("mod", MOD)
-        FIELD_CHECK("pow", POW)
-        FIELD_CHECK("unm", UNM)
-        FIELD_CHECK("concat", CONCAT)
-        FIELD_CHECK("len", LEN)
-        FIELD_CHECK("eq", EQ)
-        FIELD_CHECK("lt", LT)
-        FIELD_CHECK("le", LE)
-        FIELD_CHECK("index", INDEX)
-        FIELD_CHECK("newindex", NEWINDEX)
-        FIELD_CHECK("call", CALL)
-        FIELD_CHECK("gc", GC)
-        FIELD_CHECK("tostring", TOSTRING)
+        }
+
+        FIELD_CHECK(ADD)
+        FIELD_CHECK(SUB)
+        FIELD_CHECK(MUL)
+        FIELD_CHECK(DIV)
+        FIELD_CHECK(MOD)
+        FIELD_CHECK(POW)
+        FIELD_CHECK(UNM)
+        FIELD_CHECK(CONCAT)
+        FIELD_CHECK(LEN)
+        FIELD_CHECK(EQ)
+        FIELD_CHECK(LT)
+        FIELD_CHECK(LE)
+        FIELD_CHECK(INDEX)
+        FIELD_CHECK(NEWINDEX)
+        FIELD_CHECK(CALL)
+        FIELD_CHECK(GC)
+        FIELD_CHECK(TOSTRING)
 
 #if LUA_VERSION_NUM > 501
-        FIELD_CHECK("pairs", PAIRS)
+        FIELD_CHECK(PAIRS)
 
 #if LUA_VERSION_NUM == 502
-        FIELD_CHECK("ipairs", IPAIRS)
+        FIELD_CHECK(IPAIRS)
 #endif
 
 #if LUA_VERSION_NUM > 502
-        FIELD_CHECK("idiv", IDIV)
-        FIELD_CHECK("band", BAND)
-        FIELD_CHECK("bor", BOR)
-        FIELD_CHECK("bxor", BXOR)
-        FIELD_CHECK("bnot", BNOT)
-        FIELD_CHECK("shl", SHL)
-        FIELD_CHECK("shr", SHR)
-
-        FIELD_CHECK("name", NAME)
+        FIELD_CHECK(IDIV)
+        FIELD_CHECK(BAND)
+        FIELD_CHECK(BOR)
+        FIELD_CHECK(BXOR)
+        FIELD_CHECK(BNOT)
+        FIELD_CHECK(SHL)
+        FIELD_CHECK(SHR)
+
+        FIELD_CHECK(NAME)
 #if LUA_VERSION_NUM > 503
-        FIELD_CHECK("close", CLOSE)
+        FIELD_CHECK(CLOSE)
 #endif /* LUA_VERSION_NUM > 503 */
 #endif /* LUA_VERSION_NUM > 502 */
 #endif /* LUA_VERSION_NUM > 501 */
@@ -1118,8 +1554,12 @@ struct ffi_module {
         lua_getfield(L, -1, "__ffi_metatypes");
         /* the metatype */
         lua_pushvalue(L, 2);
+        int mt = luaL_ref(L, -2);
+        lua_pop(L, 2);
+        std::unique_ptr<int[]> handlers{new int[ffi::METATYPE_SLOTS]};
+        std::copy(refs, refs + ffi::METATYPE_SLOTS, handlers.get());
         const_cast<ast::c_record &>(ct.record()).metatype(
-            luaL_ref(L, -2), mflags
+            mt, mflags, std::move(handlers)
         );
 
         lua_pushvalue(L, 1);
@@ -1141,24 +1581,36 @@ struct ffi_module {
 
     static int addressof_f(lua_State *L) {
         auto &cd = ffi::checkcdata<void *>(L, 1);
-        ffi::newcdata<void *>(L, ast::c_type{cd.decl.unref(), 0}).val =
-            cd.decl.is_ref() ? cd.val : &cd.val;
+        ffi::newcdata<void *>(L, ast::c_type{cd.decl->unref(), 0}).val =
+            cd.decl->is_ref() ? cd.val : &cd.val;
         return 1;
     }
 
     static int gc_f(lua_State *L) {
         auto &cd = ffi::checkcdata<ffi::noval>(L, 1);
+        bool had = ffi::cdata_has_finalizer(cd);
         if (lua_isnil(L, 2)) {
             /* if nil and there is an existing finalizer, unset */
-            if (cd.gc_ref != LUA_REFNIL) {
+            if (cd.gc_ref >= 0) {
                 luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
                 cd.gc_ref = LUA_REFNIL;
+            } else if (cd.gc_ref <= ffi::GC_NATIVE_BASE) {
+                cd.gc_ref = LUA_REFNIL;
             }
-        } else {
+        } else if (!ffi::set_native_gc(L, cd, 2)) {
             /* new finalizer can be any type, it's pcall'd */
+            if (cd.gc_ref >= 0) {
+                luaL_unref(L, LUA_REGISTRYINDEX, cd.gc_ref);
+            }
             lua_pushvalue(L, 2);
             cd.gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
         }
+        if (
+            (cd.aux & ffi::CDATA_AUX_COUNTED) &&
+            (had != ffi::cdata_has_finalizer(cd))
+        ) {
+            ffi::stats_finalizer(L, had ? -1 : 1);
+        }
         lua_pushvalue(L, 1); /* return the cdata */
         return 1;
     }
@@ -1185,10 +1637,10 @@ struct ffi_module {
                 sz = size_t(isz);
             } else {
                 auto &cd = ffi::tocdata<ffi::arg_stor_t>(L, 2);
-                if (!cd.decl.integer()) {
+                if (!cd.decl->integer()) {
                     luaL_checkinteger(L, 2);
                 }
-                if (cd.decl.is_unsigned()) {
+                if (cd.decl->is_unsigned()) {
                     sz = ffi::check_arith<size_t>(L, 2);
                 } else {
                     auto isz = ffi::check_arith<long long>(L, 2);
@@ -1232,6 +1684,12 @@ struct ffi_module {
         return 0;
     }
 
+    static int field_f(lua_State *L) {
+        auto &ct = check_ct(L, 1);
+        field_meta::compile(L, ct, luaL_checkstring(L, 2));
+        return 1;
+    }
+
     static int istype_f(lua_State *L) {
         auto &ct = check_ct(L, 1);
         if (!ffi::iscdata(L, 2)) {
@@ -1242,16 +1700,16 @@ struct ffi_module {
         if (ct.type() == ast::C_BUILTIN_RECORD) {
             /* if ct is a struct, accept pointers/refs to the struct */
             /* TODO: also applies to union */
-            auto ctp = cd.decl.type();
+            auto ctp = cd.decl->type();
             if (ctp == ast::C_BUILTIN_PTR) {
-                lua_pushboolean(L, ct.is_same(cd.decl.ptr_base(), true));
+                lua_pushboolean(L, ct.is_same(cd.decl->ptr_base(), true));
                 return 1;
-            } else if (cd.decl.is_ref()) {
-                lua_pushboolean(L, ct.is_same(cd.decl, true, !ct.is_ref()));
+            } else if (cd.decl->is_ref()) {
+                lua_pushboolean(L, ct.is_same(*cd.decl, true, !ct.is_ref()));
                 return 1;
             }
         }
-        lua_pushboolean(L, ct.is_same(cd.decl, true));
+        lua_pushboolean(L, ct.is_same(*cd.decl, true));
         return 1;
     }
 
@@ -1299,15 +1757,15 @@ struct ffi_module {
                     L, false, idx, "cannot convert 'ctype' to 'void *'"
                 );
             }
-            auto ctp = cd.decl.type();
+            auto ctp = cd.decl->type();
             if (
                 (ctp != ast::C_BUILTIN_PTR) &&
                 (ctp != ast::C_BUILTIN_ARRAY) &&
-                !cd.decl.is_ref()
+                !cd.decl->is_ref()
             ) {
                 lua_pushfstring(
                     L, "cannot convert '%s' to 'void *'",
-                    cd.decl.serialize().c_str()
+                    cd.decl->serialize().c_str()
                 );
                 luaL_argcheck(L, false, idx, lua_tostring(L, -1));
             }
@@ -1344,6 +1802,41 @@ struct ffi_module {
         return 0;
     }
 
+    static int cdef_save_f(lua_State *L) {
+        std::string out;
+        /* images hold parsed declarations only */
+        parser::resolve_all(L);
+        try {
+            ast::decl_store::get_main(L).save(out);
+        } catch (ast::image_error const &e) {
+            luaL_error(L, "cannot save declarations: %s", e.what());
+        }
+        lua_pushlstring(L, out.data(), out.size());
+        return 1;
+    }
+
+    static int cdef_load_f(lua_State *L) {
+        char const *buf;
+        size_t len;
+        if (lua_type(L, 1) == LUA_TSTRING) {
+            buf = lua_tolstring(L, 1, &len);
+        } else {
+            /* e.g. a mapped file */
+            buf = static_cast<char const *>(check_voidptr(L, 1));
+            len = ffi::check_arith<size_t>(L, 2);
+        }
+        try {
+            ast::decl_store ds{ast::decl_store::get_main(L)};
+            ds.load(buf, len);
+            ds.commit();
+        } catch (ast::redefine_error const &e) {
+            luaL_error(L, "'%s' redefined", e.what());
+        } catch (ast::image_error const &e) {
+            luaL_error(L, "cannot load declarations: %s", e.what());
+        }
+        return 0;
+    }
+
     static int fill_f(lua_State *L) {
         void *dst = check_voidptr(L, 1);
         size_t len = ffi::check_arith<size_t>(L, 2);
@@ -1352,13 +1845,273 @@ struct ffi_module {
         return 0;
     }
 
+    /* arrays or pointers to arithmetic types for the bulk conversions;
+     * returns the element type, with the number of elements when known
+     */
+    static ast::c_type const &check_arith_array(
+        lua_State *L, int idx, void *&ptr, size_t &nelems
+    ) {
+        auto &cd = ffi::checkcdata<void *>(L, idx);
+        void **valp = &cd.val;
+        if (cd.decl->is_ref()) {
+            valp = reinterpret_cast<void **>(*valp);
+        }
+        if (ffi::isctype(cd) || !cd.decl->ptr_like()) {
+            lua_pushfstring(
+                L, "cannot convert '%s' to an array",
+                cd.decl->serialize().c_str()
+            );
+            luaL_argcheck(L, false, idx, lua_tostring(L, -1));
+        }
+        auto &tp = cd.decl->ptr_base();
+        if (!tp.arith()) {
+            lua_pushfstring(
+                L, "'%s' is not an array of arithmetic type",
+                cd.decl->serialize().c_str()
+            );
+            luaL_argcheck(L, false, idx, lua_tostring(L, -1));
+        }
+        ptr = *valp;
+        nelems = ~size_t(0);
+        if (cd.decl->type() == ast::C_BUILTIN_ARRAY) {
+            if (cd.decl->is_ref()) {
+                if (!cd.decl->vla() && !cd.decl->unbounded()) {
+                    nelems = cd.decl->array_size();
+                }
+            } else {
+                nelems = ffi::cdata_value_size(L, idx) / tp.alloc_size();
+            }
+        }
+        return tp;
+    }
+
+    static int fromtable_f(lua_State *L) {
+        void *dst;
+        size_t nelems;
+        auto &tp = check_arith_array(L, 1, dst, nelems);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        size_t len;
+        if (lua_isnoneornil(L, 3)) {
+            len = lua_rawlen(L, 2);
+        } else {
+            len = ffi::check_arith<size_t>(L, 3);
+        }
+        luaL_argcheck(L, len <= nelems, 3, "too many elements");
+        ffi::from_lua_array(L, tp, dst, 2, 1, len);
+        return 0;
+    }
+
+    static int totable_f(lua_State *L) {
+        void *src;
+        size_t nelems;
+        auto &tp = check_arith_array(L, 1, src, nelems);
+        size_t len = nelems;
+        if (!lua_isnoneornil(L, 2)) {
+            len = ffi::check_arith<size_t>(L, 2);
+            luaL_argcheck(L, len <= nelems, 2, "too many elements");
+        } else if (len == ~size_t(0)) {
+            luaL_argcheck(L, false, 2, "length must be given for pointers");
+        }
+        if (lua_isnoneornil(L, 3)) {
+            lua_createtable(L, int(len), 0);
+        } else {
+            luaL_checktype(L, 3, LUA_TTABLE);
+            lua_pushvalue(L, 3);
+        }
+        ffi::to_lua_array(L, tp, src, lua_gettop(L), 1, len);
+        return 1;
+    }
+
+    static int arena_f(lua_State *L) {
+        auto *ar = lua_newuserdata(L, sizeof(ffi::cdata_arena));
+        new (ar) ffi::cdata_arena{};
+        luaL_setmetatable(L, lua::CFFI_ARENA_MT);
+        return 1;
+    }
+
+    static int async_f(lua_State *L) {
+        auto *fd = ffi::testcdata<ffi::fdata>(L, 1);
+        if (!fd || ffi::isctype(*fd) || !fd->decl->callable()) {
+            lua::type_error(L, 1, "function cdata");
+        }
+        ffi::async_cif(*fd, L, lua_gettop(L) - 1);
+        return 1;
+    }
+
+    static int dispatch_f(lua_State *L) {
+        lua_Integer max = luaL_optinteger(L, 1, 0);
+        luaL_argcheck(L, max >= 0, 1, "invalid count");
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_QUEUE);
+        auto *q = lua::touserdata<ffi::cb_queue>(L, -1);
+        lua_pop(L, 1);
+        lua_pushinteger(L, lua_Integer(
+            ffi::dispatch_queued(L, *q, size_t(max))
+        ));
+        return 1;
+    }
+
+    static int cbstats_f(lua_State *L) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+        auto *cp = lua::touserdata<ffi::closure_pool>(L, -1);
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, lua_Integer(cp->live));
+        lua_setfield(L, -2, "live");
+        lua_pushinteger(L, lua_Integer(cp->cached()));
+        lua_setfield(L, -2, "cached");
+        lua_pushinteger(L, lua_Integer(cp->created));
+        lua_setfield(L, -2, "created");
+        lua_pushinteger(L, lua_Integer(cp->recycled));
+        lua_setfield(L, -2, "recycled");
+        return 1;
+    }
+
+    static int declstats_f(lua_State *L) {
+        auto st = ast::decl_store::get_main(L).get_stats();
+        lua_createtable(L, 0, 9);
+        lua_pushinteger(L, lua_Integer(st.decls));
+        lua_setfield(L, -2, "decls");
+        lua_pushinteger(L, lua_Integer(st.decl_bytes));
+        lua_setfield(L, -2, "decl_bytes");
+        lua_pushinteger(L, lua_Integer(st.names));
+        lua_setfield(L, -2, "names");
+        lua_pushinteger(L, lua_Integer(st.name_bytes));
+        lua_setfield(L, -2, "name_bytes");
+        lua_pushinteger(L, lua_Integer(st.types));
+        lua_setfield(L, -2, "types");
+        lua_pushinteger(L, lua_Integer(st.lazy_pending));
+        lua_setfield(L, -2, "lazy");
+        lua_pushinteger(L, lua_Integer(st.lazy_source));
+        lua_setfield(L, -2, "lazy_source");
+        lua_pushinteger(L, lua_Integer(st.arena.used));
+        lua_setfield(L, -2, "arena_used");
+        lua_pushinteger(L, lua_Integer(st.arena.size));
+        lua_setfield(L, -2, "arena_size");
+        return 1;
+    }
+
+    static int pool_f(lua_State *L) {
+        if (!lua_isnoneornil(L, 1)) {
+            if (lua_toboolean(L, 1)) {
+                pool::enable(L);
+            } else {
+                pool::disable(L);
+            }
+        }
+        auto st = pool::get_stats(L);
+        lua_createtable(L, 0, 4);
+        lua_pushboolean(L, st.enabled);
+        lua_setfield(L, -2, "enabled");
+        lua_pushinteger(L, lua_Integer(st.hits));
+        lua_setfield(L, -2, "hits");
+        lua_pushinteger(L, lua_Integer(st.misses));
+        lua_setfield(L, -2, "misses");
+        lua_pushinteger(L, lua_Integer(st.cached));
+        lua_setfield(L, -2, "cached");
+        return 1;
+    }
+
+    static void stats_push_entry(
+        lua_State *L, ffi::alloc_stats::entry const &ent
+    ) {
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, lua_Integer(ent.live));
+        lua_setfield(L, -2, "live");
+        lua_pushinteger(L, lua_Integer(ent.bytes));
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, lua_Integer(ent.allocs));
+        lua_setfield(L, -2, "allocs");
+    }
+
+    static void stats_add_field(lua_State *L, char const *name, size_t v) {
+        lua_getfield(L, -1, name);
+        lua_Integer ov = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_pushinteger(L, ov + lua_Integer(v));
+        lua_setfield(L, -2, name);
+    }
+
+    static int stats_f(lua_State *L) {
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_ALLOC_STATS);
+        auto &st = *lua::touserdata<ffi::alloc_stats>(L, -1);
+        lua_pop(L, 1);
+        auto now = std::chrono::steady_clock::now();
+        if (!lua_isnoneornil(L, 1)) {
+            bool on = lua_toboolean(L, 1);
+            if (on && !st.enabled) {
+                /* start counting anew; whatever is still alive from
+                 * before stays accounted for until it's collected
+                 */
+                for (auto it = st.types.begin(); it != st.types.end();) {
+                    if (!it->second.live) {
+                        it = st.types.erase(it);
+                        continue;
+                    }
+                    it->second.allocs = 0;
+                    ++it;
+                }
+                st.allocs = 0;
+                st.since = now;
+                ++ffi::alloc_stats_users;
+            } else if (!on && st.enabled) {
+                st.until = now;
+                --ffi::alloc_stats_users;
+            }
+            st.enabled = on;
+        }
+        double secs = std::chrono::duration<double>(
+            (st.enabled ? now : st.until) - st.since
+        ).count();
+        lua_createtable(L, 0, 9);
+        lua_pushboolean(L, st.enabled);
+        lua_setfield(L, -2, "enabled");
+        lua_pushinteger(L, lua_Integer(st.live));
+        lua_setfield(L, -2, "live");
+        lua_pushinteger(L, lua_Integer(st.bytes));
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, lua_Integer(st.allocs));
+        lua_setfield(L, -2, "allocs");
+        lua_pushnumber(L, lua_Number(secs));
+        lua_setfield(L, -2, "elapsed");
+        lua_pushnumber(L, (secs > 0) ? lua_Number(st.allocs / secs) : 0);
+        lua_setfield(L, -2, "rate");
+        lua_pushinteger(L, lua_Integer(st.finalizers));
+        lua_setfield(L, -2, "finalizers");
+        lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+        auto *cp = lua::touserdata<ffi::closure_pool>(L, -1);
+        lua_pop(L, 1);
+        lua_pushinteger(L, lua_Integer(cp->live));
+        lua_setfield(L, -2, "closures");
+        /* keyed by type name; distinct types may print the same, e.g.
+         * anonymous records, so those are summed up
+         */
+        lua_newtable(L);
+        for (auto &p: st.types) {
+            auto name = p.first->serialize();
+            lua_pushlstring(L, name.data(), name.size());
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                stats_push_entry(L, p.second);
+                lua_rawset(L, -3);
+                continue;
+            }
+            stats_add_field(L, "live", p.second.live);
+            stats_add_field(L, "bytes", p.second.bytes);
+            stats_add_field(L, "allocs", p.second.allocs);
+            lua_pop(L, 2);
+        }
+        lua_setfield(L, -2, "types");
+        return 1;
+    }
+
     static int tonumber_f(lua_State *L) {
         auto *cd = ffi::testcdata<void *>(L, 1);
         if (cd) {
-            ast::c_type const *tp = &cd->decl;
+            ast::c_type const *tp = cd->decl;
             void *val = &cd->val;
-            int btp = cd->decl.type();
-            if (cd->decl.is_ref()) {
+            int btp = cd->decl->type();
+            if (cd->decl->is_ref()) {
                 val = cd->val;
             }
             if (tp->arith()) {
@@ -1388,7 +2141,7 @@ struct ffi_module {
 
     static int toretval_f(lua_State *L) {
         auto &cd = ffi::checkcdata<void *>(L, 1);
-        ffi::to_lua(L, cd.decl, &cd.val, ffi::RULE_RET);
+        ffi::to_lua(L, *cd.decl, &cd.val, ffi::RULE_RET);
         return 1;
     }
 
@@ -1472,10 +2225,14 @@ struct ffi_module {
         static luaL_Reg const lib_def[] = {
             /* core */
             {"cdef", cdef_f},
+            {"cdef_lazy", cdef_lazy_f},
+            {"cdef_save", cdef_save_f},
+            {"cdef_load", cdef_load_f},
             {"load", load_f},
 
             /* data handling */
             {"new", new_f},
+            {"new_uninit", new_uninit_f},
             {"cast", cast_f},
             {"metatype", metatype_f},
             {"typeof", typeof_f},
@@ -1486,6 +2243,7 @@ struct ffi_module {
             {"sizeof", sizeof_f},
             {"alignof", alignof_f},
             {"offsetof", offsetof_f},
+            {"field", field_f},
             {"istype", istype_f},
 
             /* utilities */
@@ -1493,6 +2251,15 @@ struct ffi_module {
             {"string", string_f},
             {"copy", copy_f},
             {"fill", fill_f},
+            {"fromtable", fromtable_f},
+            {"totable", totable_f},
+            {"pool", pool_f},
+            {"arena", arena_f},
+            {"async", async_f},
+            {"dispatch", dispatch_f},
+            {"cbstats", cbstats_f},
+            {"declstats", declstats_f},
+            {"stats", stats_f},
             {"toretval", toretval_f},
             {"eval", eval_f},
             {"type", type_f},
@@ -1545,12 +2312,106 @@ struct ffi_module {
         /* stack: empty */
     }
 
+    static void setup_ct_cache(lua_State *L) {
+        /* plain data, so no finalizer; the table is held by the registry */
+        auto *cc = lua::newuserdata<ct_cache>(L);
+        lua_newtable(L);
+        cc->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        cc->gen = 0;
+        cc->count = 0;
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CT_CACHE);
+    }
+
+    static void setup_cb_queue(lua_State *L) {
+        auto *q = lua::newuserdata<ffi::cb_queue>(L);
+        new (q) ffi::cb_queue{};
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            using T = ffi::cb_queue;
+            auto *cq = lua::touserdata<T>(LL, 1);
+            /* release anything still waiting on us */
+            ffi::purge_queued(*cq, nullptr);
+            cq->~T();
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CB_QUEUE);
+    }
+
+    static void setup_closure_pool(lua_State *L) {
+        auto *cp = lua::newuserdata<ffi::closure_pool>(L);
+        new (cp) ffi::closure_pool{};
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            lua::touserdata<ffi::closure_pool>(LL, 1)->close();
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_CLOSURE_POOL);
+    }
+
+    static void setup_native_gc(lua_State *L) {
+        auto *ng = lua::newuserdata<ffi::native_gc>(L);
+        new (ng) ffi::native_gc{};
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_NATIVE_GC);
+    }
+
+    static void setup_alloc_stats(lua_State *L) {
+        auto *st = lua::newuserdata<ffi::alloc_stats>(L);
+        new (st) ffi::alloc_stats{};
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            /* cdata may still be collected after this, so the counters
+             * are only emptied and marked as gone, not destroyed
+             */
+            auto &sst = *lua::touserdata<ffi::alloc_stats>(LL, 1);
+            if (sst.enabled) {
+                --ffi::alloc_stats_users;
+                sst.enabled = false;
+            }
+            sst.closed = true;
+            decltype(sst.types){}.swap(sst.types);
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_ALLOC_STATS);
+    }
+
+    static void setup_weak(lua_State *L, char const *key, char const *mode) {
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, mode);
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, key);
+    }
+
     static void open(lua_State *L) {
         setup_dstor(L); /* declaration store */
+        setup_ct_cache(L); /* parsed type cache */
+        setup_cb_queue(L); /* queued callback invocations */
+        setup_closure_pool(L); /* released callbacks for reuse */
+        setup_native_gc(L); /* C functions used as finalizers */
+        setup_alloc_stats(L); /* opt-in allocation accounting */
+        /* callbacks made for lua functions passed to C */
+        setup_weak(L, lua::CFFI_CB_CACHE, "k");
+        setup_weak(L, lua::CFFI_CB_FUNCS, "v");
 
         /* cdata handles */
         cdata_meta::setup(L);
 
+        /* asynchronous call handles */
+        async_meta::setup(L);
+
+        /* cdata arenas */
+        arena_meta::setup(L);
+
+        /* field accessors */
+        field_meta::setup(L);
+
         setup(L); /* push table to stack */
 
         /* lib handles, needs the module table on the stack */
@@ -1560,6 +2421,14 @@ struct ffi_module {
     }
 };
 
+int arena_meta::new_f(lua_State *L) {
+    auto &ar = check(L);
+    ffi::make_cdata(
+        L, ffi_module::check_ct(L, 2), ffi::RULE_CONV, 3, &ar
+    );
+    return 1;
+}
+
 void ffi_module_open(lua_State *L) {
     ffi_module::open(L);
 }
@@ -378,4 +378,24 @@ void *get_sym(c_lib const *cl, lua_State *L, char const *name) {
     return p;
 }
 
+bool get_cached(c_lib const *cl, lua_State *L, void const *key) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cl->cache);
+    lua_pushlightuserdata(L, const_cast<void *>(key));
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return false;
+    }
+    lua_replace(L, -2);
+    return true;
+}
+
+void set_cached(c_lib const *cl, lua_State *L, void const *key) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cl->cache);
+    lua_pushlightuserdata(L, const_cast<void *>(key));
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
 } /* namespace lib */
@@ -21,6 +21,14 @@ void close(c_lib *cl, lua_State *L);
 
 void *get_sym(c_lib const *cl, lua_State *L, char const *name);
 
+/* per-library cache of objects keyed by identity (e.g. a declaration);
+ * get_cached pushes the value and returns true if present, otherwise it
+ * pushes nothing, set_cached stores the value on top of the stack while
+ * leaving it there
+ */
+bool get_cached(c_lib const *cl, lua_State *L, void const *key);
+void set_cached(c_lib const *cl, lua_State *L, void const *key);
+
 bool is_c(c_lib const *cl);
 
 } /* namespace lib */
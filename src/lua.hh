@@ -100,6 +100,17 @@ static constexpr int CFFI_CTYPE_TAG = -128;
 static constexpr char const CFFI_CDATA_MT[] = "cffi_cdata_handle";
 static constexpr char const CFFI_LIB_MT[] = "cffi_lib_handle";
 static constexpr char const CFFI_DECL_STOR[] = "cffi_decl_stor";
+static constexpr char const CFFI_CT_CACHE[] = "cffi_ct_cache";
+static constexpr char const CFFI_POOL[] = "cffi_pool";
+static constexpr char const CFFI_ASYNC_MT[] = "cffi_async_handle";
+static constexpr char const CFFI_ARENA_MT[] = "cffi_arena_handle";
+static constexpr char const CFFI_FIELD_MT[] = "cffi_field_handle";
+static constexpr char const CFFI_CB_QUEUE[] = "cffi_cb_queue";
+static constexpr char const CFFI_CLOSURE_POOL[] = "cffi_closure_pool";
+static constexpr char const CFFI_CB_CACHE[] = "cffi_cb_cache";
+static constexpr char const CFFI_CB_FUNCS[] = "cffi_cb_funcs";
+static constexpr char const CFFI_NATIVE_GC[] = "cffi_native_gc";
+static constexpr char const CFFI_ALLOC_STATS[] = "cffi_alloc_stats";
 
 template<typename T>
 static T *newuserdata(lua_State *L, size_t extra = 0) {
@@ -0,0 +1,91 @@
+#include <cstdint>
+
+#include "platform.hh"
+#include "pages.hh"
+
+#if FFI_OS == FFI_OS_WINDOWS
+#include <windows.h>
+#elif FFI_OS != FFI_OS_OTHER
+#define FFI_USE_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+namespace pages {
+
+#if FFI_OS == FFI_OS_WINDOWS
+
+void *map(std::size_t size) {
+    return VirtualAlloc(
+        nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE
+    );
+}
+
+void unmap(void *p, std::size_t) {
+    VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#elif defined(FFI_USE_MMAP) && defined(MAP_ANONYMOUS)
+
+/* the usual size of a transparent huge page */
+static constexpr std::size_t HUGE_SIZE = std::size_t(1) << 21;
+
+void *map(std::size_t size) {
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_SIZE) {
+        /* huge pages need aligned memory, so map more than needed and
+         * give back what sticks out on either side
+         */
+        std::size_t msize = size + HUGE_SIZE;
+        void *mp = mmap(
+            nullptr, msize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        );
+        if (mp == MAP_FAILED) {
+            return nullptr;
+        }
+        auto pgsz = std::uintptr_t(sysconf(_SC_PAGESIZE));
+        auto beg = reinterpret_cast<std::uintptr_t>(mp);
+        auto abeg = (beg + HUGE_SIZE - 1) & ~std::uintptr_t(HUGE_SIZE - 1);
+        auto aend = abeg + ((size + pgsz - 1) & ~(pgsz - 1));
+        if (abeg > beg) {
+            munmap(mp, abeg - beg);
+        }
+        if ((beg + msize) > aend) {
+            munmap(reinterpret_cast<void *>(aend), beg + msize - aend);
+        }
+        void *ret = reinterpret_cast<void *>(abeg);
+        /* only a hint, failure does not matter */
+        madvise(ret, size, MADV_HUGEPAGE);
+        return ret;
+    }
+#endif
+    void *ret = mmap(
+        nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (ret == MAP_FAILED) {
+        return nullptr;
+    }
+    return ret;
+}
+
+void unmap(void *p, std::size_t size) {
+    munmap(p, size);
+}
+
+#else
+
+void *map(std::size_t) {
+    return nullptr;
+}
+
+void unmap(void *, std::size_t) {
+}
+
+#endif
+
+} /* namespace pages */
@@ -0,0 +1,25 @@
+#ifndef PAGES_HH
+#define PAGES_HH
+
+#include <cstddef>
+
+/* Large blocks of memory taken directly from the system rather than from
+ * the allocator of the Lua state. This is used for big arrays, which then
+ * start out zeroed without having to be cleared, and which can be backed
+ * by huge pages where the system supports that.
+ */
+
+namespace pages {
+
+/* arrays of at least this many bytes get pages of their own */
+static constexpr std::size_t MAP_MIN = std::size_t(1) << 20;
+
+/* returns zeroed memory or nullptr when the system does not provide it */
+void *map(std::size_t size);
+
+/* the size must be the same as passed to map */
+void unmap(void *p, std::size_t size);
+
+} /* namespace pages */
+
+#endif /* PAGES_HH */
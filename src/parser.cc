@@ -6,7 +6,6 @@
 #include <stack>
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <utility>
 #include <stdexcept>
 #include <memory>
@@ -95,20 +94,102 @@ struct lex_token {
     ast::c_value value{};
 };
 
-static thread_local std::unordered_map<
-    char const *, int, util::str_hash, util::str_equal
-> keyword_map;
+/* keywords are recognized with a perfect hash; the table is built at
+ * compile time and the assertion below trips when a newly added keyword
+ * collides with another, which means the hash needs adjusting
+ */
 
-static void init_kwmap() {
-    if (!keyword_map.empty()) {
-        return;
+#define KW(x) #x
+
+static constexpr char const *kw_names[] = {KEYWORDS};
+
+#undef KW
+
+static constexpr std::size_t KW_NUM = sizeof(kw_names) / sizeof(*kw_names);
+static constexpr std::size_t KW_TABLE_SIZE = 256;
+
+static constexpr std::size_t kw_hash(char const *str, std::size_t len) {
+    return (
+        (
+            std::size_t(static_cast<unsigned char>(str[0])) +
+            std::size_t(static_cast<unsigned char>(str[len - 1])) +
+            std::size_t(static_cast<unsigned char>(str[len / 2]))
+        ) * 7 + len
+    ) & (KW_TABLE_SIZE - 1);
+}
+
+struct kw_table {
+    /* keyword number plus one, zero for none */
+    unsigned char idx[KW_TABLE_SIZE];
+    unsigned char len[KW_NUM];
+    bool perfect;
+};
+
+static constexpr kw_table kw_build() {
+    kw_table ret{{}, {}, true};
+    for (std::size_t i = 0; i < KW_NUM; ++i) {
+        std::size_t len = 0;
+        while (kw_names[i][len]) {
+            ++len;
+        }
+        auto h = kw_hash(kw_names[i], len);
+        if (ret.idx[h]) {
+            ret.perfect = false;
+        }
+        ret.idx[h] = static_cast<unsigned char>(i + 1);
+        ret.len[i] = static_cast<unsigned char>(len);
     }
-    auto nkw = int(
-        sizeof(tokens) / sizeof(tokens[0]) + TOK_CUSTOM - TOK_NAME - 1
-    );
-    for (int i = 1; i <= nkw; ++i) {
-        keyword_map[tokens[TOK_NAME - TOK_CUSTOM + i]] = i;
+    return ret;
+}
+
+static constexpr kw_table kw_tab = kw_build();
+
+static_assert(kw_tab.perfect, "keyword hash has collisions");
+
+/* the keyword number like the token offset from TOK_NAME, or zero */
+static inline int kw_lookup(char const *str, std::size_t len) {
+    int i = kw_tab.idx[kw_hash(str, len)];
+    if (!i || (kw_tab.len[i - 1] != len)) {
+        return 0;
     }
+    if (memcmp(kw_names[i - 1], str, len)) {
+        return 0;
+    }
+    return i;
+}
+
+/* character classes for the lexer, so that the common runs of input can
+ * be skipped in tight loops; only plain ASCII counts, like in C
+ */
+
+enum char_class {
+    CC_SPACE = 1 << 0, /* whitespace other than newlines */
+    CC_IDENT = 1 << 1, /* may continue an identifier */
+    CC_IDSTART = 1 << 2, /* may start an identifier */
+};
+
+struct cc_table {
+    unsigned char cls[256];
+};
+
+static constexpr cc_table cc_build() {
+    cc_table ret{{}};
+    ret.cls[int(' ')] = ret.cls[int('\t')] = CC_SPACE;
+    ret.cls[int('\v')] = ret.cls[int('\f')] = CC_SPACE;
+    for (int c = 'a'; c <= 'z'; ++c) {
+        ret.cls[c] = ret.cls[c - 'a' + 'A'] = CC_IDENT | CC_IDSTART;
+    }
+    ret.cls[int('_')] = CC_IDENT | CC_IDSTART;
+    for (int c = '0'; c <= '9'; ++c) {
+        ret.cls[c] = CC_IDENT;
+    }
+    return ret;
+}
+
+static constexpr cc_table cc_tab = cc_build();
+
+static inline bool cc_is(int c, int cls) {
+    return !!(cc_tab.cls[static_cast<unsigned char>(c)] & cls);
 }
 
 struct lex_state_error: public std::runtime_error {
@@ -137,31 +218,38 @@ struct lex_state {
         p_mode(pmode), p_pidx(paridx), p_L(L), stream(str),
         send(estr), p_buf{}, p_dstore{ast::decl_store::get_main(L)}
     {
-        /* thread-local, initialize for parsing thread */
-        init_kwmap();
+        init();
+    }
 
-        /* this should be enough that we should never have to resize it */
-        p_buf.reserve(256);
+    /* for lazy declarations parsed in the middle of something else; they
+     * see what the outer state has staged so far and commit into it
+     */
+    lex_state(lex_state &outer, char const *str, char const *estr):
+        p_pidx(-1), p_L(outer.p_L), stream(str), send(estr), p_buf{},
+        p_dstore{outer.p_dstore}, p_taken{outer.p_taken}
+    {
+        init();
+    }
 
-        /* read first char */
-        next_char();
+    ~lex_state() {}
 
-        /* skip past potential UTF-8 BOM */
-        if (current != 0xEF) {
-            return;
+    /* where the next token begins, or some whitespace before it */
+    char const *position() const {
+        if ((stream == send) && !current) {
+            return send;
         }
-        next_char();
-        if (current != 0xBB) {
-            return;
-        }
-        next_char();
-        if (current != 0xBF) {
-            return;
-        }
-        next_char();
+        return stream - 1;
     }
 
-    ~lex_state() {}
+    /* lazy declarations taken while parsing are recorded here, so that
+     * they can be put back if the whole thing fails
+     */
+    void track_lazy(std::vector<std::size_t> &ids) {
+        p_taken = &ids;
+    }
+
+    void parse_lazy(std::vector<std::size_t> const &ids);
+    void parse_nested(ast::decl_store::lazy_decl const &d);
 
     int get() {
         if (lahead.token >= 0) {
@@ -195,18 +283,59 @@ struct lex_state {
         }
     }
 
+    /* declarations and their names are kept by the main store */
+    template<typename T, typename ...A>
+    T *make_decl(A &&...args) {
+        return p_dstore.make<T>(std::forward<A>(args)...);
+    }
+
+    char const *intern_name(std::string const &name) {
+        return p_dstore.intern_name(name);
+    }
+
+    /* variables and typedefs may be declared again, which does nothing;
+     * nothing is made for those, as the memory would stay with the store
+     */
+    bool redeclared(char const *name) const {
+        return !!p_dstore.lookup_interned(name);
+    }
+
     void commit() {
         p_dstore.commit();
     }
 
-    ast::c_object const *lookup(char const *name) const {
-        return p_dstore.lookup(name);
+    ast::c_object *lookup(char const *name) {
+        auto *o = p_dstore.lookup(name);
+        if (!o && resolve_lazy(name)) {
+            o = p_dstore.lookup(name);
+        }
+        return o;
     }
 
-    ast::c_object *lookup(char const *name) {
+    /* a mere reference to a tag does not need its definition right away,
+     * and the definition may well depend on what is being parsed now; so
+     * it gets resolved before the enclosing record is laid out, or at the
+     * end at the latest
+     */
+    ast::c_object *lookup_tag(char const *name) {
+        if (p_mode == PARSE_MODE_NOTCDEF) {
+            return lookup(name);
+        }
+        if (ast::decl_store::get_main(p_L).lazy_pending()) {
+            p_deferred.emplace_back(name);
+        }
         return p_dstore.lookup(name);
     }
 
+    /* only the tags deferred since 'from', for when a type has to be
+     * complete right away, like in sizeof
+     */
+    void resolve_deferred(std::size_t from = 0);
+
+    std::size_t deferred() const {
+        return p_deferred.size();
+    }
+
     std::string request_name() const {
         return p_dstore.request_name();
     }
@@ -264,13 +393,38 @@ struct lex_state {
         if (!luaL_testudata(p_L, p_pidx, lua::CFFI_CDATA_MT)) {
             syntax_error("type expected");
         }
-        auto ct = *lua::touserdata<ast::c_type>(p_L, p_pidx);
+        /* both cdata and ctypes start with the interned type pointer */
+        auto ct = **lua::touserdata<ast::c_type const *>(p_L, p_pidx);
         get(); /* consume $ */
         ++p_pidx;
         return ct;
     }
 
 private:
+    void init() {
+        /* this should be enough that we should never have to resize it */
+        p_buf.reserve(256);
+
+        /* read first char */
+        next_char();
+
+        /* skip past potential UTF-8 BOM */
+        if (current != 0xEF) {
+            return;
+        }
+        next_char();
+        if (current != 0xBB) {
+            return;
+        }
+        next_char();
+        if (current != 0xBF) {
+            return;
+        }
+        next_char();
+    }
+
+    bool resolve_lazy(char const *name);
+
     void ensure_pidx() {
         if ((p_pidx <= 0) || lua_isnone(p_L, p_pidx)) {
             syntax_error("wrong number of type parameters");
@@ -291,6 +445,12 @@ private:
         return ret;
     }
 
+    /* continue from the given point in the stream */
+    void skip_to(char const *p) {
+        stream = p;
+        next_char();
+    }
+
     char upcoming() const {
         if (stream == send) {
             return '\0';
@@ -556,28 +716,37 @@ private:
             case '/': {
                 next_char();
                 if (current == '*') {
-                    next_char();
-                    while (current) {
-                        if (current == '*') {
-                            next_char();
-                            if (current == '/') {
-                                next_char();
-                                goto cont;
+                    /* the body is skipped in bulk, counting lines */
+                    char const *p = stream;
+                    for (; p != send; ++p) {
+                        if (*p == '*') {
+                            if (((p + 1) != send) && (p[1] == '/')) {
+                                break;
+                            }
+                        } else if (*p == '\n') {
+                            ++line_number;
+                        } else if (*p == '\r') {
+                            /* \r\n is counted at the \n */
+                            if (((p + 1) == send) || (p[1] != '\n')) {
+                                ++line_number;
                             }
                         }
-                        next_char();
                     }
-                    syntax_error("unterminated comment");
+                    if (p == send) {
+                        syntax_error("unterminated comment");
+                    }
+                    skip_to(p + 2);
+                    continue;
                 } else if (current != '/') {
                     /* just / */
                     return '/';
                 }
-                /* C++ style comment */
-                next_char();
-                while (current && !is_newline(current)) {
-                    next_char();
+                /* C++ style comment, up to the newline */
+                char const *p = stream;
+                while ((p != send) && (*p != '\n') && (*p != '\r')) {
+                    ++p;
                 }
-cont:
+                skip_to(p);
                 continue;
             }
             /* =, == */
@@ -715,29 +884,30 @@ cont:
             }
             /* single-char tokens, number literals, keywords, names */
             default: {
-                if (isspace(current)) {
-                    next_char();
+                if (cc_is(current, CC_SPACE)) {
+                    char const *p = stream;
+                    while ((p != send) && cc_is(*p, CC_SPACE)) {
+                        ++p;
+                    }
+                    skip_to(p);
                     continue;
                 } else if (isdigit(current)) {
                     read_integer(tok);
                     return TOK_INTEGER;
                 }
-                if (isalpha(current) || (current == '_')) {
-                    /* names, keywords */
-                    /* what current pointed to */
-                    /* keep reading until we readh non-matching char */
-                    p_buf.clear();
-                    do {
-                        p_buf.push_back(next_char());
-                    } while (isalnum(current) || (current == '_'));
-                    std::string name{p_buf.begin(), p_buf.end()};
-                    /* could be a keyword? */
-                    auto kwit = keyword_map.find(name.c_str());
-                    tok.value_s = std::move(name);
-                    if (kwit != keyword_map.end()) {
-                        return TOK_NAME + kwit->second;
+                if (cc_is(current, CC_IDSTART)) {
+                    /* names, keywords; current came from just before
+                     * the stream, so the name can be taken from there
+                     */
+                    char const *beg = stream - 1;
+                    char const *p = stream;
+                    while ((p != send) && cc_is(*p, CC_IDENT)) {
+                        ++p;
                     }
-                    return TOK_NAME;
+                    auto len = std::size_t(p - beg);
+                    tok.value_s.assign(beg, len);
+                    skip_to(p);
+                    return TOK_NAME + kw_lookup(beg, len);
                 }
                 /* single-char token */
                 int c = current;
@@ -757,6 +927,8 @@ cont:
 
     std::vector<char> p_buf;
     ast::decl_store p_dstore;
+    std::vector<std::size_t> *p_taken = nullptr;
+    std::vector<std::string> p_deferred{};
 
 public:
     int line_number = 1;
@@ -996,8 +1168,11 @@ static ast::c_expr parse_cexpr_simple(lex_state &ls) {
             ls.get();
             int line = ls.line_number;
             check_next(ls, '(');
+            auto ndef = ls.deferred();
             auto tp = parse_type(ls);
             check_match(ls, ')', '(', line);
+            /* the size of a lazy record is only known once it's parsed */
+            ls.resolve_deferred(ndef);
             ast::c_expr ret;
             size_t align = tp.libffi_type()->size;
             if (sizeof(unsigned long long) > sizeof(void *)) {
@@ -1014,8 +1189,10 @@ static ast::c_expr parse_cexpr_simple(lex_state &ls) {
             ls.get();
             int line = ls.line_number;
             check_next(ls, '(');
+            auto ndef = ls.deferred();
             auto tp = parse_type(ls);
             check_match(ls, ')', '(', line);
+            ls.resolve_deferred(ndef);
             ast::c_expr ret;
             size_t align = tp.libffi_type()->alignment;
             if (sizeof(unsigned long long) > sizeof(void *)) {
@@ -1239,9 +1416,10 @@ static std::vector<ast::c_param> parse_paramlist(lex_state &ls) {
     for (;;) {
         if (ls.t.token == TOK_ELLIPSIS) {
             /* varargs, insert a sentinel type (will be dropped) */
-            params.emplace_back(std::string{}, ast::c_type{
-                ast::C_BUILTIN_VOID, 0
-            });
+            params.emplace_back(
+                ls.intern_name(std::string{}),
+                ast::c_type{ast::C_BUILTIN_VOID, 0}
+            );
             ls.get();
             /* varargs ends the arglist */
             break;
@@ -1259,7 +1437,7 @@ static std::vector<ast::c_param> parse_paramlist(lex_state &ls) {
         if (pname == "?") {
             pname.clear();
         }
-        params.emplace_back(std::move(pname), std::move(pt));
+        params.emplace_back(ls.intern_name(pname), std::move(pt));
         if (!test_next(ls, ',')) {
             break;
         }
@@ -1570,18 +1748,25 @@ newlevel:
              * are already consumed since before
              */
             auto argl = parse_paramlist(ls);
+            /* attribute style calling convention after paramlist */
+            auto cconv = parse_callconv_attrib(ls);
+            if (cconv == ast::C_FUNC_DEFAULT) {
+                cconv = prevconv;
+            }
+            /* parsing may resolve lazy declarations, which parse types
+             * of their own and may reallocate the queue, so only refer
+             * to the level once it's done
+             */
             auto &clev = pcvq[ridx];
             new (&clev.argl) std::vector<ast::c_param>(std::move(argl));
             clev.is_func = true;
-            /* attribute style calling convention after paramlist */
-            clev.cconv = parse_callconv_attrib(ls);
-            if (clev.cconv == ast::C_FUNC_DEFAULT) {
-                clev.cconv = prevconv;
-            }
+            clev.cconv = cconv;
         } else if (ls.t.token == '[') {
             /* array dimensions may be multiple */
             int flags;
-            pcvq[ridx].arrd = parse_array(ls, flags);
+            /* same as above, dimensions may refer to lazy declarations */
+            auto arrd = parse_array(ls, flags);
+            pcvq[ridx].arrd = arrd;
             pcvq[ridx].flags = flags;
         }
         if (!pcvq[ridx].is_func && (prevconv != ast::C_FUNC_DEFAULT)) {
@@ -1969,11 +2154,13 @@ static ast::c_record const &parse_record(lex_state &ls, bool *newst) {
 
     /* opaque */
     if (!test_next(ls, '{')) {
-        auto *oldecl = ls.lookup(sname.c_str());
+        auto *oldecl = ls.lookup_tag(sname.c_str());
         if (!oldecl || (oldecl->obj_type() != ast::c_object_type::RECORD)) {
             mode_error();
             /* different type or not stored yet, raise error or store */
-            auto *p = new ast::c_record{std::move(sname), is_uni};
+            auto *p = ls.make_decl<ast::c_record>(
+                ls.intern_name(sname), is_uni
+            );
             ls.store_decl(p, sline);
             return *p;
         }
@@ -1990,7 +2177,9 @@ static ast::c_record const &parse_record(lex_state &ls, bool *newst) {
             bool transp = false;
             auto &st = parse_record(ls, &transp);
             if (transp && test_next(ls, ';')) {
-                fields.emplace_back(std::string{}, ast::c_type{&st, 0});
+                fields.emplace_back(
+                    ls.intern_name(std::string{}), ast::c_type{&st, 0}
+                );
                 continue;
             }
             tpb = ast::c_type{&st, parse_cv(ls)};
@@ -2006,7 +2195,7 @@ static ast::c_record const &parse_record(lex_state &ls, bool *newst) {
                 goto field_end;
             }
             flexible = tp.unbounded();
-            fields.emplace_back(std::move(fpn), std::move(tp));
+            fields.emplace_back(ls.intern_name(fpn), std::move(tp));
             /* unbounded array must be the last in the list */
             if (flexible) {
                 break;
@@ -2022,6 +2211,9 @@ field_end:
 
     check_match(ls, '}', '{', linenum);
 
+    /* members must be complete for the layout */
+    ls.resolve_deferred();
+
     auto *oldecl = ls.lookup(sname.c_str());
     if (oldecl && (oldecl->obj_type() == ast::c_object_type::RECORD)) {
         auto &st = oldecl->as<ast::c_record>();
@@ -2038,7 +2230,9 @@ field_end:
     if (newst) {
         *newst = true;
     }
-    auto *p = new ast::c_record{std::move(sname), std::move(fields), is_uni};
+    auto *p = ls.make_decl<ast::c_record>(
+        ls.intern_name(sname), std::move(fields), is_uni
+    );
     ls.store_decl(p, sline);
     return *p;
 }
@@ -2068,10 +2262,10 @@ static ast::c_enum const &parse_enum(lex_state &ls) {
     };
 
     if (!test_next(ls, '{')) {
-        auto *oldecl = ls.lookup(ename.c_str());
+        auto *oldecl = ls.lookup_tag(ename.c_str());
         if (!oldecl || (oldecl->obj_type() != ast::c_object_type::ENUM)) {
             mode_error();
-            auto *p = new ast::c_enum{std::move(ename)};
+            auto *p = ls.make_decl<ast::c_enum>(ls.intern_name(ename));
             ls.store_decl(p, eline);
             return *p;
         }
@@ -2086,7 +2280,7 @@ static ast::c_enum const &parse_enum(lex_state &ls) {
         int eln = ls.line_number;
         ls.param_maybe_name();
         check(ls, TOK_NAME);
-        std::string fname = ls.t.value_s;
+        auto *fname = ls.intern_name(ls.t.value_s);
         ls.get();
         if (ls.t.token == '=') {
             ls.get();
@@ -2106,10 +2300,10 @@ static ast::c_enum const &parse_enum(lex_state &ls) {
                     ls.syntax_error("unsupported type");
                     break;
             }
-            fields.emplace_back(std::move(fname), val.i);
+            fields.emplace_back(fname, val.i);
         } else {
             fields.emplace_back(
-                std::move(fname), fields.empty() ? 0 : (fields.back().value + 1)
+                fname, fields.empty() ? 0 : (fields.back().value + 1)
             );
         }
         /* enums: register fields as constant values
@@ -2118,9 +2312,9 @@ static ast::c_enum const &parse_enum(lex_state &ls) {
         auto &fld = fields.back();
         ast::c_value fval;
         fval.i = fld.value;
-        auto *p = new ast::c_constant{
+        auto *p = ls.make_decl<ast::c_constant>(
             fld.name, ast::c_type{ast::C_BUILTIN_INT, 0}, fval
-        };
+        );
         ls.store_decl(p, eln);
         if (ls.t.token != ',') {
             break;
@@ -2141,7 +2335,9 @@ static ast::c_enum const &parse_enum(lex_state &ls) {
         }
     }
 
-    auto *p = new ast::c_enum{std::move(ename), std::move(fields)};
+    auto *p = ls.make_decl<ast::c_enum>(
+        ls.intern_name(ename), std::move(fields)
+    );
     ls.store_decl(p, eline);
     return *p;
 }
@@ -2164,6 +2360,10 @@ static void parse_decl(lex_state &ls) {
             if (tp.type() != ast::C_BUILTIN_FUNC) {
                 ls.syntax_error("calling convention on non-function declaration");
             }
+            if (!tp.owns()) {
+                /* e.g. an interned type from a parameter, don't modify it */
+                tp = ast::c_type{tp.function(), uint32_t(tp.cv())};
+            }
             auto *func = const_cast<ast::c_function *>(&tp.function());
             func->callconv(cconv);
         }
@@ -2173,9 +2373,12 @@ static void parse_decl(lex_state &ls) {
                 /* store if the name is non-empty, if it's empty there is no
                  * way to access the type and it'd be unique either way
                  */
-                ls.store_decl(
-                    new ast::c_typedef{std::move(dname), std::move(tp)}, dline
-                );
+                auto *iname = ls.intern_name(dname);
+                if (!ls.redeclared(iname)) {
+                    ls.store_decl(ls.make_decl<ast::c_typedef>(
+                        iname, std::move(tp)
+                    ), dline);
+                }
                 continue;
             } else {
                 /* unnamed typedef must not be a list */
@@ -2198,9 +2401,12 @@ static void parse_decl(lex_state &ls) {
             ls.get();
             check_match(ls, ')', '(', lnum);
         }
-        ls.store_decl(new ast::c_variable{
-            std::move(dname), std::move(sym), std::move(tp)
-        }, dline);
+        auto *iname = ls.intern_name(dname);
+        if (!ls.redeclared(iname)) {
+            ls.store_decl(ls.make_decl<ast::c_variable>(
+                iname, ls.intern_name(sym), std::move(tp)
+            ), dline);
+        }
     } while (test_next(ls, ','));
 }
 
@@ -2219,26 +2425,333 @@ static void parse_decls(lex_state &ls) {
     }
 }
 
+/* lazy declarations
+ *
+ * lazy input only gets tokenized and split into top level declarations,
+ * each of which is indexed by the names it may declare: tags that are
+ * defined or forward declared, enum constants and declarator names; it does
+ * not hurt to index a name which is not actually declared there, the worst
+ * that can happen is that the declaration gets parsed earlier than needed
+ *
+ * parsing one then happens on the first lookup of any of its names, in the
+ * middle of whatever did the lookup, which takes care of dependencies
+ */
+
+void lex_state::parse_nested(ast::decl_store::lazy_decl const &d) {
+    lex_state ls{*this, d.beg, d.end};
+    ls.line_number = d.line;
+    ls.get();
+    parse_decls(ls);
+    ls.resolve_deferred();
+    ls.commit();
+}
+
+void lex_state::resolve_deferred(std::size_t from) {
+    while (p_deferred.size() > from) {
+        auto name = std::move(p_deferred.back());
+        p_deferred.pop_back();
+        resolve_lazy(name.c_str());
+    }
+}
+
+void lex_state::parse_lazy(std::vector<std::size_t> const &ids) {
+    auto &ds = ast::decl_store::get_main(p_L);
+    if (p_taken) {
+        p_taken->insert(p_taken->end(), ids.begin(), ids.end());
+    }
+    for (auto id: ids) {
+        /* copy, the nested parse may look up more */
+        auto d = ds.lazy_get(id);
+        parse_nested(d);
+    }
+}
+
+bool lex_state::resolve_lazy(char const *name) {
+    auto &ds = ast::decl_store::get_main(p_L);
+    std::vector<std::size_t> ids;
+    if (!ds.lazy_take(name, ids)) {
+        return false;
+    }
+    parse_lazy(ids);
+    return true;
+}
+
+enum lazy_paren {
+    LAZY_PAREN_GROUP, /* grouping in a declarator */
+    LAZY_PAREN_MAYBE, /* grouping or a list, depends on what follows */
+    LAZY_PAREN_LIST, /* parameter list or an expression */
+    LAZY_PAREN_SKIP, /* arguments of attributes and such */
+};
+
+enum lazy_pending {
+    LAZY_PENDING_NONE = 0,
+    LAZY_PENDING_TAG,
+    LAZY_PENDING_DECL,
+};
+
+struct lazy_span {
+    ast::decl_store::lazy_decl decl;
+    std::vector<std::string> names;
+};
+
+static void scan_lazy(lex_state &ls, std::vector<lazy_span> &out) {
+    static constexpr std::size_t NO_ENUM = ~std::size_t(0);
+    std::vector<int> parens;
+    /* paren depth at which enum bodies start, NO_ENUM for other bodies */
+    std::vector<std::size_t> braces;
+    std::vector<std::string> names;
+    std::string pname;
+    int pend = LAZY_PENDING_NONE;
+    int nlist = 0, prev = 0, tag = 0, ntoks = 0;
+    bool enum_body = false, enum_name = false;
+
+    char const *beg = ls.position();
+    int line = ls.line_number;
+    ls.get();
+    for (;;) {
+        int tok = ls.t.token;
+        /* first decide what the previous token left open */
+        if (pend == LAZY_PENDING_TAG) {
+            if ((tok == '{') || (tok == ';')) {
+                names.push_back(std::move(pname));
+            }
+        } else if (pend == LAZY_PENDING_DECL) {
+            switch (tok) {
+                case ')': case '[': case ',': case ';': case '=': case '(':
+                case ':': case -1: case TOK___asm__: case TOK___attribute__:
+                    names.push_back(std::move(pname));
+                    break;
+                default:
+                    break;
+            }
+        }
+        pend = LAZY_PENDING_NONE;
+        if (!parens.empty() && (parens.back() == LAZY_PAREN_MAYBE)) {
+            switch (tok) {
+                case '*': case '^': case '&': case TOK___cdecl:
+                case TOK___fastcall: case TOK___stdcall: case TOK___thiscall:
+                    parens.back() = LAZY_PAREN_GROUP;
+                    --nlist;
+                    break;
+                default:
+                    parens.back() = LAZY_PAREN_LIST;
+                    break;
+            }
+        }
+        int ntag = 0;
+        bool nenum_body = false, nenum_name = false;
+        switch (tok) {
+            case -1:
+                if (!parens.empty() || !braces.empty()) {
+                    ls.lex_error("unfinished declaration", -1);
+                }
+                /* FALLTHROUGH */
+            case ';':
+                if (!parens.empty() || !braces.empty()) {
+                    break;
+                }
+                if (ntoks) {
+                    out.push_back(lazy_span{
+                        {beg, ls.position(), line, false}, std::move(names)
+                    });
+                    names.clear();
+                }
+                if (tok < 0) {
+                    return;
+                }
+                beg = ls.position();
+                line = ls.line_number;
+                prev = 0;
+                ntoks = 0;
+                ls.get();
+                continue;
+            case '$':
+                ls.syntax_error("type parameters are not allowed here");
+                break;
+            case '(':
+                if (
+                    (!parens.empty() && (parens.back() == LAZY_PAREN_SKIP)) ||
+                    (prev == TOK___attribute__) || (prev == TOK___asm__) ||
+                    (prev == TOK___declspec)
+                ) {
+                    parens.push_back(LAZY_PAREN_SKIP);
+                    ++nlist;
+                } else if (
+                    (prev == TOK_NAME) || (prev == ')') || (prev == ']')
+                ) {
+                    parens.push_back(LAZY_PAREN_MAYBE);
+                    ++nlist;
+                } else {
+                    parens.push_back(LAZY_PAREN_GROUP);
+                }
+                break;
+            case ')':
+                if (!parens.empty()) {
+                    if (parens.back() != LAZY_PAREN_GROUP) {
+                        --nlist;
+                    }
+                    parens.pop_back();
+                }
+                break;
+            case '{':
+                braces.push_back(enum_body ? parens.size() : NO_ENUM);
+                nenum_name = enum_body;
+                break;
+            case '}':
+                if (!braces.empty()) {
+                    braces.pop_back();
+                }
+                break;
+            case ',':
+                nenum_name = !braces.empty() &&
+                    (braces.back() == parens.size());
+                break;
+            case TOK_struct:
+            case TOK_union:
+                ntag = tok;
+                break;
+            case TOK_enum:
+                ntag = tok;
+                nenum_body = true;
+                break;
+            case TOK_NAME:
+                if (tag) {
+                    switch (tag) {
+                        case TOK_struct: pname = "struct "; break;
+                        case TOK_union: pname = "union "; break;
+                        default: pname = "enum "; break;
+                    }
+                    pname += ls.t.value_s;
+                    pend = LAZY_PENDING_TAG;
+                    nenum_body = enum_body;
+                } else if (enum_name) {
+                    names.push_back(ls.t.value_s);
+                } else if (braces.empty() && !nlist) {
+                    pname = ls.t.value_s;
+                    pend = LAZY_PENDING_DECL;
+                }
+                break;
+            default:
+                break;
+        }
+        tag = ntag;
+        enum_body = nenum_body;
+        enum_name = nenum_name;
+        prev = tok;
+        ++ntoks;
+        ls.get();
+    }
+}
+
+/* runs a parse that may take lazy declarations, putting them back if it
+ * fails; the error is only raised once everything has been cleaned up, as
+ * raising it does not unwind the stack
+ */
+template<typename F>
+static void parse_root(lua_State *L, bool lnum, F &&func) {
+    bool err = false;
+    {
+        std::vector<std::size_t> taken;
+        try {
+            func(taken);
+        } catch (lex_state_error const &e) {
+            ast::decl_store::get_main(L).lazy_restore(taken);
+            luaL_where(L, 1);
+            if (lnum) {
+                lua_pushfstring(L, "input:%d: ", e.line_number);
+            } else {
+                lua_pushliteral(L, "");
+            }
+            if (e.token > 0) {
+                lua_pushfstring(
+                    L, "%s near '%s'", e.what(), token_to_str(e.token).c_str()
+                );
+            } else {
+                lua_pushstring(L, e.what());
+            }
+            lua_concat(L, 3);
+            err = true;
+        }
+    }
+    if (err) {
+        lua_error(L);
+    }
+}
+
+void parse_lazy(lua_State *L, char const *input, char const *iend) {
+    if (!iend) {
+        iend = input + strlen(input);
+    }
+    parse_root(L, true, [L, input, iend](std::vector<std::size_t> &taken) {
+        auto &ds = ast::decl_store::get_main(L);
+        auto len = std::size_t(iend - input);
+        std::unique_ptr<char[]> src{new char[len + 1]};
+        memcpy(src.get(), input, len);
+        src[len] = '\0';
+        char const *sbeg = src.get();
+        std::vector<lazy_span> spans;
+        {
+            lex_state ls{L, sbeg, sbeg + len};
+            scan_lazy(ls, spans);
+        }
+        ds.lazy_source(std::move(src), len);
+        /* declarations that have no name to look them up by can only
+         * ever be parsed right away
+         */
+        lex_state ls{L, sbeg, sbeg};
+        ls.track_lazy(taken);
+        for (auto &sp: spans) {
+            if (sp.names.empty()) {
+                ls.parse_nested(sp.decl);
+            } else {
+                ds.lazy_add(sp.decl, sp.names);
+            }
+        }
+        ls.resolve_deferred();
+        ls.commit();
+    });
+}
+
+static void resolve_root(lua_State *L, char const *name) {
+    if (!ast::decl_store::get_main(L).lazy_pending()) {
+        return;
+    }
+    parse_root(L, true, [L, name](std::vector<std::size_t> &taken) {
+        lex_state ls{L, "", ""};
+        ls.track_lazy(taken);
+        if (name) {
+            ls.lookup(name);
+        } else {
+            std::vector<std::size_t> ids;
+            ast::decl_store::get_main(L).lazy_take_all(ids);
+            ls.parse_lazy(ids);
+        }
+        ls.resolve_deferred();
+        ls.commit();
+    });
+}
+
+void resolve(lua_State *L, char const *name) {
+    resolve_root(L, name);
+}
+
+void resolve_all(lua_State *L) {
+    resolve_root(L, nullptr);
+}
+
 void parse(lua_State *L, char const *input, char const *iend, int paridx) {
     if (!iend) {
         iend = input + strlen(input);
     }
-    try {
+    parse_root(L, true, [=](std::vector<std::size_t> &taken) {
         lex_state ls{L, input, iend, PARSE_MODE_DEFAULT, paridx};
+        ls.track_lazy(taken);
         /* read first token */
         ls.get();
         parse_decls(ls);
+        ls.resolve_deferred();
         ls.commit();
-    } catch (lex_state_error const &e) {
-        if (e.token > 0) {
-            luaL_error(
-                L, "input:%d: %s near '%s'", e.line_number, e.what(),
-                token_to_str(e.token).c_str()
-            );
-        } else {
-            luaL_error(L, "input:%d: %s", e.line_number, e.what());
-        }
-    }
+    });
 }
 
 ast::c_type parse_type(
@@ -2247,23 +2760,15 @@ ast::c_type parse_type(
     if (!iend) {
         iend = input + strlen(input);
     }
-    try {
+    ast::c_type ret{ast::C_BUILTIN_INVALID, 0};
+    parse_root(L, false, [=, &ret](std::vector<std::size_t> &taken) {
         lex_state ls{L, input, iend, PARSE_MODE_NOTCDEF, paridx};
+        ls.track_lazy(taken);
         ls.get();
-        auto tp = parse_type(ls);
+        ret = parse_type(ls);
         ls.commit();
-        return tp;
-    } catch (lex_state_error const &e) {
-        if (e.token > 0) {
-            luaL_error(
-                L, "%s near '%s'", e.what(), token_to_str(e.token).c_str()
-            );
-        } else {
-            luaL_error(L, "%s", e.what());
-        }
-    }
-    /* unreachable */
-    return ast::c_type{ast::C_BUILTIN_INVALID, 0};
+    });
+    return ret;
 }
 
 ast::c_expr_type parse_number(
@@ -22,6 +22,15 @@ static inline void parse(
     parse(L, input.c_str(), input.c_str() + input.size(), paridx);
 }
 
+/* only indexes the declarations, they get parsed on first lookup */
+void parse_lazy(lua_State *L, char const *input, char const *iend = nullptr);
+
+/* parses whatever lazy declarations may declare the name */
+void resolve(lua_State *L, char const *name);
+
+/* parses all pending lazy declarations */
+void resolve_all(lua_State *L);
+
 ast::c_type parse_type(
     lua_State *L, char const *input, char const *iend = nullptr, int paridx = -1
 );
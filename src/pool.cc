@@ -0,0 +1,136 @@
+#include <new>
+
+#include "pool.hh"
+
+namespace pool {
+
+/* how many blocks of one size we're willing to hold on to */
+static constexpr std::size_t MAX_CACHED = 64;
+
+struct pool_state {
+    lua_Alloc falloc;
+    void *fud;
+    bool installed;
+    bool active;
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t cached;
+    void *bins[MAX_SIZE + 1];
+    std::size_t counts[MAX_SIZE + 1];
+};
+
+static void *pool_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    auto *ps = static_cast<pool_state *>(ud);
+    if (!ps->active) {
+        return ps->falloc(ps->fud, ptr, osize, nsize);
+    }
+    if (!ptr) {
+        /* new block; osize may be a type tag here */
+        if ((nsize >= sizeof(void *)) && (nsize <= MAX_SIZE)) {
+            void *p = ps->bins[nsize];
+            if (p) {
+                ps->bins[nsize] = *static_cast<void **>(p);
+                --ps->counts[nsize];
+                --ps->cached;
+                ++ps->hits;
+                return p;
+            }
+            ++ps->misses;
+        }
+    } else if (!nsize) {
+        /* freed block, keep it if there is room */
+        if (
+            (osize >= sizeof(void *)) && (osize <= MAX_SIZE) &&
+            (ps->counts[osize] < MAX_CACHED)
+        ) {
+            *static_cast<void **>(ptr) = ps->bins[osize];
+            ps->bins[osize] = ptr;
+            ++ps->counts[osize];
+            ++ps->cached;
+            return nullptr;
+        }
+    }
+    return ps->falloc(ps->fud, ptr, osize, nsize);
+}
+
+static void drain(pool_state *ps) {
+    for (std::size_t i = 0; i <= MAX_SIZE; ++i) {
+        while (ps->bins[i]) {
+            void *p = ps->bins[i];
+            ps->bins[i] = *static_cast<void **>(p);
+            ps->falloc(ps->fud, p, i, 0);
+        }
+        ps->counts[i] = 0;
+    }
+    ps->cached = 0;
+}
+
+/* take the pool out of the allocator chain if we're still on top; if
+ * someone else wrapped the allocator after us, we have to stay in place
+ * and only pass everything through
+ */
+static bool detach(lua_State *L, pool_state *ps) {
+    ps->active = false;
+    drain(ps);
+    void *ud;
+    if ((lua_getallocf(L, &ud) == pool_alloc) && (ud == ps)) {
+        lua_setallocf(L, ps->falloc, ps->fud);
+        ps->installed = false;
+        return true;
+    }
+    return false;
+}
+
+static pool_state *get_state(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, lua::CFFI_POOL);
+    auto *pp = static_cast<pool_state **>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return pp ? *pp : nullptr;
+}
+
+void enable(lua_State *L) {
+    auto *ps = get_state(L);
+    if (!ps) {
+        auto *pp = lua::newuserdata<pool_state *>(L);
+        *pp = nullptr;
+        lua_newtable(L);
+        lua_pushcfunction(L, [](lua_State *LL) -> int {
+            auto *&rps = *lua::touserdata<pool_state *>(LL, 1);
+            /* state is going away; if we cannot leave the chain, the
+             * pool state must stay alive, it's merely a passthrough now
+             */
+            if (rps && detach(LL, rps)) {
+                delete rps;
+            }
+            rps = nullptr;
+            return 0;
+        });
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        ps = *pp = new pool_state{};
+        lua_setfield(L, LUA_REGISTRYINDEX, lua::CFFI_POOL);
+    }
+    if (!ps->installed) {
+        ps->falloc = lua_getallocf(L, &ps->fud);
+        lua_setallocf(L, pool_alloc, ps);
+        ps->installed = true;
+    }
+    ps->active = true;
+}
+
+void disable(lua_State *L) {
+    auto *ps = get_state(L);
+    if (ps) {
+        detach(L, ps);
+    }
+}
+
+stats get_stats(lua_State *L) {
+    auto *ps = get_state(L);
+    if (!ps) {
+        return stats{false, 0, 0, 0};
+    }
+    return stats{ps->active, ps->hits, ps->misses, ps->cached};
+}
+
+} /* namespace pool */
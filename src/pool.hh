@@ -0,0 +1,37 @@
+#ifndef POOL_HH
+#define POOL_HH
+
+#include <cstddef>
+
+#include "lua.hh"
+
+/* An optional pool of small memory blocks, plugged into the allocator of
+ * the Lua state. Freed blocks of up to MAX_SIZE bytes are kept around in
+ * freelists of their exact size and handed out again for the same size,
+ * which is what happens all the time with short-lived scalar cdata (e.g.
+ * 64-bit integer arithmetic results).
+ *
+ * The blocks always come from the original allocator, so the pool can be
+ * removed or drained at any point without having to know where any given
+ * block came from.
+ */
+
+namespace pool {
+
+static constexpr std::size_t MAX_SIZE = 256;
+
+struct stats {
+    bool enabled;
+    std::size_t hits; /* allocations served from the pool */
+    std::size_t misses; /* allocations of poolable size that were not */
+    std::size_t cached; /* blocks currently held by the pool */
+};
+
+void enable(lua_State *L);
+void disable(lua_State *L);
+
+stats get_stats(lua_State *L);
+
+} /* namespace pool */
+
+#endif /* POOL_HH */
@@ -0,0 +1,89 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    typedef struct ar_point {
+        int x, y;
+        double z;
+    } ar_point;
+]]
+
+local ar = ffi.arena()
+assert(tostring(ar):match("^arena: "))
+
+-- records are initialized like with new, but we get a pointer
+
+local p = ar:new("ar_point", 1, 2, 3.5)
+assert(ffi.istype("ar_point *", p))
+assert(p.x == 1 and p.y == 2 and p.z == 3.5)
+p.x = 10
+assert(p.x == 10)
+
+local q = ar:new("ar_point", { y = 5 })
+assert(q.x == 0 and q.y == 5 and q.z == 0)
+
+-- arrays give a pointer to the first element
+
+local a = ar:new("int[4]", { 1, 2, 3, 4 })
+assert(ffi.istype("int *", a))
+assert(a[0] == 1 and a[3] == 4)
+
+local v = ar:new("double[?]", 8)
+assert(ffi.istype("double *", v))
+for i = 0, 7 do
+    assert(v[i] == 0)
+    v[i] = i
+end
+assert(v[7] == 7)
+
+-- scalars too
+
+local n = ar:new("long", 42)
+assert(ffi.istype("long *", n))
+assert(n[0] == 42)
+
+-- storage is maximally aligned
+
+local addr = ffi.tonumber(ffi.cast("uintptr_t", ar:new("char")))
+assert(addr % ffi.alignof("double") == 0)
+
+-- metatypes apply to the pointers
+
+local mp = ffi.metatype("struct { int v; }", {
+    __index = { get = function(self) return self.v end }
+})
+local m = ar:new(mp, 7)
+assert(m:get() == 7)
+
+-- function pointers can't go in an arena
+
+assert(not pcall(ar.new, ar, "void (*)(void)"))
+
+-- bad initializers raise errors like with new
+
+assert(not pcall(ar.new, ar, "ar_point", "foo"))
+
+-- reset releases everything at once, but keeps the memory for reuse
+
+for i = 1, 2000 do
+    ar:new("ar_point")
+end
+local st = ar:stats()
+assert(st.chunks > 1)
+assert(st.used >= 2000 * ffi.sizeof("ar_point"))
+ar:reset()
+local rst = ar:stats()
+assert(rst.used == 0)
+assert(rst.size == st.size and rst.chunks == st.chunks)
+p = ar:new("ar_point", 4)
+assert(p.x == 4 and p.y == 0)
+for i = 1, 1999 do
+    ar:new("ar_point")
+end
+assert(ar:stats().size == st.size)
+
+-- large allocations get a block of their own
+
+local big = ar:new("char[?]", 1048576)
+big[1048575] = 5
+assert(ar:stats().size >= 1048576)
+ar:reset()
@@ -0,0 +1,78 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    int test_slow_add(int a, int b, int ms);
+    typedef struct test_point { int x, y; } test_point;
+    int test_point_sum(test_point p);
+    size_t strlen(char const *s);
+    int test_snprintf(char *buf, size_t n, char const *fmt, ...);
+    void qsort(
+        void *base, size_t nmemb, size_t size,
+        int (*compar)(void const *, void const *)
+    );
+]]
+
+-- many calls running at once
+
+local hs = {}
+for i = 1, 16 do
+    hs[i] = ffi.async(ffi.C.test_slow_add, i, 10, 5)
+end
+for i, h in ipairs(hs) do
+    assert(h:wait() == i + 10)
+    assert(h:done())
+end
+
+-- polling
+
+local h = ffi.async(ffi.C.test_slow_add, 1, 2, 20)
+while not h:done() do end
+assert(h:wait() == 3)
+-- results can be collected again
+assert(h:wait() == 3)
+assert(tostring(h):match("^async: "))
+
+-- arguments are kept alive until the handle is gone
+
+local h = ffi.async(ffi.C.strlen, ("x"):rep(10) .. "y")
+collectgarbage()
+assert(ffi.tonumber(h:wait()) == 11)
+
+-- aggregates passed by value are copied when the call is made, so they
+-- can be changed right away; keep the workers busy so that the calls
+-- queue up behind the slow ones
+
+local pt = ffi.new("test_point", 1, 2)
+local busy = {}
+for i = 1, 64 do
+    busy[i] = ffi.async(ffi.C.test_slow_add, i, 0, 10)
+end
+local sums = {}
+for i = 1, 8 do
+    sums[i] = ffi.async(ffi.C.test_point_sum, pt)
+    pt.x = pt.x + 10
+end
+pt.x, pt.y = 100, 200
+for i, sh in ipairs(sums) do
+    assert(sh:wait() == 3 + (i - 1) * 10)
+end
+for i, bh in ipairs(busy) do
+    assert(bh:wait() == i)
+end
+
+-- things that can't be done off the lua thread
+
+assert(not pcall(ffi.async, ffi.C.test_snprintf, nil, 0, "foo"))
+assert(not pcall(
+    ffi.async, ffi.C.qsort, nil, 0, 0, function(a, b) return 0 end
+))
+local cb = ffi.cast("int (*)(int, int, int)", function(a, b, c) return 0 end)
+assert(not pcall(ffi.async, cb, 1, 2, 3))
+cb:free()
+assert(not pcall(ffi.async, 5))
+assert(not pcall(ffi.async, ffi.new("int")))
+
+-- handles may go away while the call is still running
+
+ffi.async(ffi.C.test_slow_add, 1, 2, 20)
+collectgarbage()
@@ -0,0 +1,98 @@
+local ffi = require("cffi")
+
+-- big arrays get memory of their own, which starts out zeroed
+
+local n = 4 * 1024 * 1024
+local buf = ffi.new("uint8_t[?]", n)
+assert(ffi.sizeof(buf) == n)
+assert(buf[0] == 0 and buf[n / 2] == 0 and buf[n - 1] == 0)
+buf[n - 1] = 0xFF
+assert(buf[n - 1] == 0xFF)
+ffi.fill(buf, n, 1)
+assert(buf[0] == 1 and buf[n - 1] == 1)
+
+local p = ffi.cast("uint8_t *", buf)
+assert(p[n - 1] == 1)
+
+-- fixed size arrays too
+
+local d = ffi.new("double[262144]")
+assert(ffi.sizeof(d) == 262144 * 8)
+assert(d[262143] == 0)
+d[262143] = 1.5
+assert(d[262143] == 1.5)
+
+-- initializers work the same
+
+local iv = ffi.new("int[?]", 300000, 7)
+assert(iv[0] == 7)
+
+local tv = ffi.new("int[?]", 300000, { 1, 2, 3 })
+assert(tv[0] == 1 and tv[2] == 3 and tv[3] == 0 and tv[299999] == 0)
+
+-- copies between big arrays
+
+local b2 = ffi.new("uint8_t[?]", n)
+ffi.copy(b2, buf, n)
+assert(b2[n - 1] == 1)
+
+-- and they go away with the cdata
+
+buf, p, d, iv, tv, b2 = nil, nil, nil, nil, nil, nil
+collectgarbage()
+collectgarbage()
+
+for i = 1, 16 do
+    local t = ffi.new("uint8_t[?]", n)
+    t[0] = i
+end
+collectgarbage()
+
+-- a stopped collector stays stopped, nothing gets finalized
+
+if _VERSION ~= "Lua 5.1" then
+    collectgarbage("stop")
+    local fin = false
+    ffi.gc(ffi.new("int"), function() fin = true end)
+    for i = 1, 16 do
+        local t = ffi.new("uint8_t[?]", n)
+        t[0] = i
+    end
+    assert(not fin)
+    collectgarbage("restart")
+    collectgarbage()
+    assert(fin)
+end
+
+-- uninitialized allocations
+
+ffi.cdef [[
+    typedef struct big_flex {
+        int n;
+        double vals[];
+    } big_flex;
+]]
+
+local u = ffi.new_uninit("char[?]", 100)
+assert(ffi.sizeof(u) == 100)
+ffi.fill(u, 100, 65)
+assert(u[99] == 65)
+
+local ub = ffi.new_uninit("uint8_t[?]", n)
+assert(ffi.sizeof(ub) == n)
+ub[n - 1] = 3
+assert(ub[n - 1] == 3)
+
+local us = ffi.new_uninit("big_flex", 4)
+us.n = 4
+us.vals[3] = 2.5
+assert(us.vals[3] == 2.5)
+assert(ffi.sizeof(us) >= ffi.sizeof("big_flex", 4))
+
+local ui = ffi.new_uninit("int")
+ui = ffi.new_uninit("int[4]")
+assert(ffi.sizeof(ui) == 16)
+
+assert(not pcall(ffi.new_uninit, "int", 5))
+assert(not pcall(ffi.new_uninit, "int[?]", 4, 5))
+assert(not pcall(ffi.new_uninit, "int[?]"))
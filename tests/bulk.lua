@@ -0,0 +1,57 @@
+local ffi = require("cffi")
+
+-- table to array
+
+local x = ffi.new("double[4]")
+ffi.fromtable(x, { 1.5, 2.5, 3.5 })
+assert(x[0] == 1.5)
+assert(x[1] == 2.5)
+assert(x[2] == 3.5)
+assert(x[3] == 0)
+
+local x = ffi.new("int[?]", 5)
+ffi.fromtable(x, { 5, 10, 15, true, ffi.new("short", 25) })
+assert(x[0] == 5)
+assert(x[2] == 15)
+assert(x[3] == 1)
+assert(x[4] == 25)
+
+-- explicit length, through a pointer
+local p = ffi.cast("int *", x)
+ffi.fromtable(p, { 1, 2, 3 }, 2)
+assert(x[0] == 1)
+assert(x[1] == 2)
+assert(x[2] == 15)
+
+assert(not pcall(ffi.fromtable, ffi.new("int[2]"), { 1, 2, 3 }))
+assert(not pcall(ffi.fromtable, x, { 1, "foo" }))
+assert(not pcall(ffi.fromtable, ffi.new("void *[2]"), { 1 }))
+
+-- array to table
+
+local t = ffi.totable(x)
+assert(#t == 5)
+assert(t[1] == 1)
+assert(t[5] == 25)
+
+local t = ffi.totable(p, 2)
+assert(#t == 2)
+assert(t[2] == 2)
+assert(not pcall(ffi.totable, p))
+
+-- filling an existing table
+local t = { "a", "b", "c" }
+ffi.totable(ffi.new("float[2]", 0.5, 0.25), nil, t)
+assert(t[1] == 0.5)
+assert(t[2] == 0.25)
+assert(t[3] == "c")
+
+local t = ffi.totable(ffi.new("bool[2]", { true, false }))
+assert(t[1] == true)
+assert(t[2] == false)
+
+-- table initializers of scalar arrays
+local x = ffi.new("unsigned char[?]", 4, { 1, 2, 255 })
+assert(x[0] == 1)
+assert(x[2] == 255)
+assert(x[3] == 0)
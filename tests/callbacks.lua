@@ -31,4 +31,103 @@ end)
 cb2(5, 3.14)
 assert(called3)
 
+-- args not taking the direct number path
+called3 = false
+cb2(ffi.new("int", 5), ffi.new("double", 3.14))
+assert(called3)
+
 cb2:free()
+
+-- return values
+local cb3 = ffi.cast("int (*)(int, int)", function(a, b)
+    return a + b
+end)
+assert(cb3(5, 10) == 15)
+-- non-number results take the generic conversion
+cb3:set(function(a, b) return ffi.new("int", a * b) end)
+assert(cb3(5, 10) == 50)
+
+cb3:free()
+
+-- copies share the closure and get invalidated along with it
+local cb4 = ffi.cast("int (*)(int)", function(a) return a + 1 end)
+local cb4c = ffi.cast("int (*)(int)", cb4)
+assert(cb4c(5) == 6)
+cb4c:free()
+assert(not pcall(cb4.free, cb4))
+
+-- freed closures get reused by callbacks with the same argument count
+local st = ffi.cbstats()
+local cb5 = ffi.cast("double (*)(double)", function(a) return a * 2 end)
+assert(cb5(2.5) == 5)
+local st2 = ffi.cbstats()
+assert(st2.live == st.live + 1)
+assert(st2.cached == st.cached - 1)
+assert(st2.recycled == st.recycled + 1)
+assert(st2.created == st.created)
+cb5:free()
+assert(ffi.cbstats().live == st.live)
+
+-- lua functions passed to C get a cached callback
+ffi.cdef [[
+    void qsort(
+        void *base, size_t nmemb, size_t size,
+        int (*compar)(void const *, void const *)
+    );
+]]
+
+local cmp = function(a, b)
+    a = ffi.cast("int const *", a)[0]
+    b = ffi.cast("int const *", b)[0]
+    return a - b
+end
+
+local arr = ffi.new("int[5]", {5, 3, 1, 4, 2})
+st = ffi.cbstats()
+ffi.C.qsort(arr, 5, ffi.sizeof("int"), cmp)
+for i = 0, 4 do
+    assert(arr[i] == i + 1)
+end
+assert(ffi.cbstats().live == st.live + 1)
+-- the same function and signature do not make a new one
+arr = ffi.new("int[5]", {4, 1, 5, 2, 3})
+ffi.C.qsort(arr, 5, ffi.sizeof("int"), cmp)
+for i = 0, 4 do
+    assert(arr[i] == i + 1)
+end
+assert(ffi.cbstats().live == st.live + 1)
+
+-- the callback goes away with the function; the cache does not need
+-- ephemerons for that, as the callback only refers to it weakly
+cmp = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.cbstats().live == st.live)
+
+-- the callback runs on the thread passing it, and keeps working when that
+-- was a coroutine which is gone by the time it's used again
+local seen
+local ccmp = function(a, b)
+    seen = coroutine.running()
+    a = ffi.cast("int const *", a)[0]
+    b = ffi.cast("int const *", b)[0]
+    return a - b
+end
+local co = coroutine.create(function()
+    local carr = ffi.new("int[5]", {3, 5, 1, 2, 4})
+    ffi.C.qsort(carr, 5, ffi.sizeof("int"), ccmp)
+    for i = 0, 4 do
+        assert(carr[i] == i + 1)
+    end
+end)
+assert(coroutine.resume(co))
+assert(seen == co)
+co = nil
+collectgarbage()
+collectgarbage()
+arr = ffi.new("int[5]", {2, 4, 1, 5, 3})
+ffi.C.qsort(arr, 5, ffi.sizeof("int"), ccmp)
+for i = 0, 4 do
+    assert(arr[i] == i + 1)
+end
+assert(seen == coroutine.running())
@@ -14,3 +14,26 @@ local op = ffi.cast("const char *", up)
 
 assert(ffi.string(op) == "hello world")
 assert(op == foop)
+
+-- pointer conversion checks; the verdicts may be remembered, so make sure
+-- that asking again gives the same answer
+
+ffi.cdef [[
+    typedef void (*cast_cb1)(int);
+    typedef void (*cast_cb2)(int, int);
+]]
+
+local cb1 = ffi.new("cast_cb1[1]")
+local cb2 = ffi.new("cast_cb2[1]")
+local cpp1 = ffi.new("cast_cb1 *", cb1)
+local cpp2 = ffi.new("cast_cb2 *", cb2)
+
+for i = 1, 3 do
+    assert(ffi.new("cast_cb1 *", cpp1) == cpp1)
+    assert(not pcall(ffi.new, "cast_cb1 *", cpp2))
+    assert(not pcall(ffi.new, "cast_cb2 *", cpp1))
+    assert(ffi.new("cast_cb1 const *", cpp1) == cpp1)
+    assert(not pcall(ffi.new, "cast_cb1 *", ffi.new("cast_cb1 const *")))
+    assert(not pcall(ffi.new, "int *", ffi.new("char *")))
+    assert(ffi.new("void *", cpp2) == cpp2)
+end
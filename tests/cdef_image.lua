@@ -0,0 +1,66 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    struct img_node;
+    typedef struct img_node img_node_t;
+
+    struct img_node {
+        img_node_t *next;
+        int vals[4];
+        union { int i; float f; };
+        struct { char a, b; } pair;
+    };
+
+    enum img_color { IMG_RED, IMG_GREEN = 5, IMG_BLUE };
+
+    typedef int (*img_cb_t)(int, char const *);
+
+    int img_snprintf(char *buf, size_t n, char const *fmt, ...)
+        __asm__("test_snprintf");
+    struct img_later *img_later_get(void);
+]]
+
+local blob = ffi.cdef_save()
+assert(type(blob) == "string")
+
+-- loading it again where it came from redefines things
+local ok, err = pcall(ffi.cdef_load, blob)
+assert(not ok)
+assert(err:find("redefined"))
+
+-- garbage is rejected
+assert(not pcall(ffi.cdef_load, "not an image"))
+assert(not pcall(ffi.cdef_load, blob:sub(1, #blob - 1)))
+
+-- a fresh state gets the same declarations without parsing
+run_isolated([==[
+    local ffi = require("cffi")
+    -- existing declarations are fine to combine with
+    ffi.cdef [[
+        struct anon_first { struct { int x; } a; };
+        struct img_later;
+    ]]
+    ffi.cdef_load(...)
+
+    assert(ffi.sizeof("struct img_node") == ffi.sizeof("img_node_t"))
+    local n = ffi.new("img_node_t")
+    n.next = n
+    n.vals[0] = 42
+    n.f = 1.5
+    n.pair.b = 65
+    assert(n.next.vals[0] == 42)
+    assert(n.i ~= 0)
+    assert(n.pair.b == 65)
+
+    assert(ffi.C.IMG_GREEN == 5)
+    assert(ffi.C.IMG_BLUE == 6)
+    assert(ffi.sizeof("enum img_color") == ffi.sizeof("int"))
+
+    local cb = ffi.cast("img_cb_t", function(a) return a + 1 end)
+    assert(cb(1, "x") == 2)
+    cb:free()
+
+    local buf = ffi.new("char[16]")
+    assert(ffi.C.img_snprintf(buf, 16, "%d", ffi.new("int", 42)) == 2)
+    assert(ffi.string(buf) == "42")
+]==], blob)
@@ -0,0 +1,79 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    typedef struct fld_inner {
+        int c;
+        double d;
+    } fld_inner;
+
+    typedef struct fld_mid {
+        char pad;
+        fld_inner in;
+    } fld_mid;
+
+    typedef struct fld_outer {
+        int x;
+        fld_mid a;
+        int arr[3];
+        fld_inner *ptr;
+        fld_inner b[];
+    } fld_outer;
+]]
+
+local o = ffi.new("fld_outer", 4)
+o.a.pad = 1
+o.a["in"].c = 42
+o.a["in"].d = 1.5
+o.b[3].c = 10
+
+-- nested reads and writes
+
+local c = ffi.field("fld_outer", "a.in.c")
+assert(c:get(o) == 42)
+c:set(o, 43)
+assert(o.a["in"].c == 43)
+
+local d = ffi.field(ffi.typeof("fld_outer"), "a.in.d")
+assert(d:get(o) == 1.5)
+
+local b3 = ffi.field("fld_outer", "b[3].c")
+assert(b3:get(o) == 10)
+b3:set(o, 11)
+assert(o.b[3].c == 11)
+
+assert(ffi.field("fld_outer", "a.pad"):get(o) == 1)
+assert(ffi.field("fld_outer", "x"):get(o) == 0)
+
+-- pointers and references to the record work too
+
+local p = ffi.cast("fld_outer *", o)
+assert(c:get(p) == 43)
+c:set(p, 44)
+assert(o.a["in"].c == 44)
+
+-- aggregate results are references into the object
+
+local inner = ffi.field("fld_outer", "a.in"):get(o)
+inner.d = 2.5
+assert(o.a["in"].d == 2.5)
+
+local mid = ffi.field("fld_mid", "in.c")
+assert(mid:get(o.a) == 44)
+
+-- errors when compiling
+
+assert(not pcall(ffi.field, "fld_outer", "nope"))
+assert(not pcall(ffi.field, "fld_outer", "arr[3]"))
+assert(not pcall(ffi.field, "fld_outer", "b[x]"))
+assert(not pcall(ffi.field, "fld_outer", "b[-1]"))
+assert(not pcall(ffi.field, "fld_outer", "a..in"))
+assert(not pcall(ffi.field, "fld_outer", ""))
+assert(not pcall(ffi.field, "fld_outer", "x[0]"))
+assert(not pcall(ffi.field, "fld_outer", "ptr.c"))
+assert(not pcall(ffi.field, "int", "x"))
+
+-- and when used with other types
+
+assert(not pcall(c.get, c, ffi.new("fld_mid")))
+assert(not pcall(c.get, c, 5))
+assert(not pcall(c.set, c, ffi.new("fld_inner"), 1))
@@ -0,0 +1,75 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    void *malloc(size_t n);
+    void free(void *p);
+    void test_release(int *p);
+    int test_released_sum(void);
+    int test_puts(char const *str);
+]]
+
+-- C functions taking a pointer and returning nothing are called directly
+
+local p = ffi.gc(ffi.C.malloc(16), ffi.C.free)
+assert(p ~= ffi.nullptr)
+p = nil
+collectgarbage()
+collectgarbage()
+
+local keep = {}
+local function tracked(v)
+    local arr = ffi.new("int[1]", v)
+    keep[#keep + 1] = arr
+    return ffi.cast("int *", arr)
+end
+
+local t1 = ffi.gc(tracked(1), ffi.C.test_release)
+local t2 = ffi.gc(tracked(2), ffi.C.test_release)
+assert(ffi.C.test_released_sum() == 0)
+t1, t2 = nil, nil
+collectgarbage()
+collectgarbage()
+assert(ffi.C.test_released_sum() == 3)
+
+-- function pointers work too
+
+local fp = ffi.cast("void (*)(int *)", ffi.C.test_release)
+local t3 = ffi.gc(tracked(4), fp)
+t3 = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.C.test_released_sum() == 7)
+
+-- arrays are passed as pointers
+
+local t4 = ffi.gc(ffi.new("int[2]", 8), ffi.C.test_release)
+t4 = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.C.test_released_sum() == 15)
+
+-- finalizers can be replaced and removed
+
+local t5 = ffi.gc(tracked(16), ffi.C.test_release)
+ffi.gc(t5, nil)
+local t6 = ffi.gc(tracked(32), function() end)
+ffi.gc(t6, ffi.C.test_release)
+local t7 = ffi.gc(tracked(64), ffi.C.test_release)
+local lcalled = false
+ffi.gc(t7, function(v) lcalled = (v[0] == 64) end)
+t5, t6, t7 = nil, nil, nil
+collectgarbage()
+collectgarbage()
+assert(ffi.C.test_released_sum() == 47)
+assert(lcalled)
+
+-- anything else still goes through lua
+
+local called = 0
+local t8 = ffi.gc(tracked(128), function(v) called = called + v[0] end)
+local t9 = ffi.gc(ffi.new("char[4]"), ffi.C.test_puts)
+t8, t9 = nil, nil
+collectgarbage()
+collectgarbage()
+assert(called == 128)
+assert(ffi.C.test_released_sum() == 47)
@@ -0,0 +1,115 @@
+local ffi = require("cffi")
+
+ffi.cdef_lazy [[
+    typedef struct lz_list lz_list_t;
+
+    struct lz_list {
+        lz_list_t *next;
+        struct lz_val *val;
+        enum lz_kind kind;
+    };
+
+    struct lz_val { int i; double d; };
+
+    enum lz_kind { LZ_NONE, LZ_INT = 5, LZ_DOUBLE };
+
+    struct lz_a { struct lz_b *b; };
+    struct lz_b { struct lz_a *a; };
+
+    int lz_broken(int x y);
+
+    size_t strlen(char const *s);
+    int (*lz_getfp)(int (*)(double), char const *);
+]]
+
+-- dependencies get pulled in as needed, in any order
+local l = ffi.new("lz_list_t")
+assert(ffi.offsetof("lz_list_t", "kind") == ffi.sizeof("void *") * 2)
+assert(ffi.istype("struct lz_list *", l.next))
+l.val = ffi.new("struct lz_val", 3, 1.5)
+assert(l.val.i == 3 and l.val.d == 1.5)
+l.kind = ffi.C.LZ_DOUBLE
+assert(l.kind == 6)
+assert(ffi.C.LZ_INT == 5)
+
+-- mutually dependent records end up pointing at each other
+local a = ffi.new("struct lz_a")
+local b = ffi.new("struct lz_b")
+a.b = b
+b.a = a
+assert(a.b.a == a)
+
+-- function declarations are resolved through the C namespace
+assert(ffi.tonumber(ffi.C.strlen("hello")) == 5)
+assert(ffi.C.LZ_NONE == 0)
+
+-- broken declarations only fail once something needs them
+local ok, err = pcall(function() return ffi.C.lz_broken end)
+assert(not ok)
+assert(err:find("input:16:"))
+
+-- array dimensions may use lazy constants and sizes of lazy records,
+-- which get parsed in the middle of the declaration that needs them
+ffi.cdef_lazy [[
+    struct lz_dims {
+        char name[LZ_DIM_N];
+        int v[sizeof(struct lz_dim_rec) / sizeof(int)];
+        int w[__alignof__(struct lz_dim_rec)];
+    };
+    enum { LZ_DIM_N = 16 };
+    struct lz_dim_rec { int x, y, z; };
+]]
+local dims = ffi.new("struct lz_dims")
+assert(ffi.sizeof(dims.name) == 16)
+assert(ffi.sizeof(dims.v) == 3 * ffi.sizeof("int"))
+assert(ffi.sizeof(dims.w) == ffi.alignof("int") * ffi.sizeof("int"))
+
+-- a failing cdef does not lose the lazy declarations it pulled in
+ffi.cdef_lazy [[
+    struct lz_late { int x; };
+]]
+ok = pcall(ffi.cdef, [[
+    struct lz_late *lz_late_get(void);
+    int lz_bad(;
+]])
+assert(not ok)
+assert(ffi.sizeof("struct lz_late") == ffi.sizeof("int"))
+
+-- the index is built up front, so unbalanced input fails right away
+ok, err = pcall(ffi.cdef_lazy, "struct lz_unfinished { int x;")
+assert(not ok)
+assert(err:find("unfinished declaration"))
+
+-- the declaration store reports on itself
+local st = ffi.declstats()
+assert(st.decls > 0 and st.lazy > 0 and st.lazy_source > 0)
+local ntypes, used = st.types, st.arena_used
+local t = ffi.typeof("struct lz_val *[3]")
+st = ffi.declstats()
+assert(st.types > ntypes and st.arena_used > used)
+assert(st.arena_size >= st.arena_used)
+
+-- declarations and names go in the arena too, names are stored only once
+local ndecls, nnames, nbytes = st.decls, st.names, st.name_bytes
+ffi.cdef [[
+    typedef int lz_stats_name_t;
+    struct lz_stats_rec { lz_stats_name_t lz_stats_name_t_field; };
+]]
+st = ffi.declstats()
+assert(st.decls == ndecls + 2 and st.decl_bytes > 0)
+assert(st.names == nnames + 3)
+assert(st.name_bytes == nbytes + #"lz_stats_name_t" + 1
+    + #"struct lz_stats_rec" + 1 + #"lz_stats_name_t_field" + 1)
+ffi.cdef [[
+    struct lz_stats_rec2 { int lz_stats_name_t; };
+]]
+st = ffi.declstats()
+assert(st.names == nnames + 4)
+
+-- declaring typedefs and externs again does not take up more memory
+local dbytes = st.decl_bytes
+ffi.cdef [[
+    typedef int lz_stats_name_t;
+    typedef int lz_stats_name_t;
+]]
+assert(ffi.declstats().decl_bytes == dbytes)
@@ -19,3 +19,29 @@ local x = foo(5, 10)
 assert(x.x == 5)
 assert(x.y == 10)
 assert(x:sum() == 15)
+
+-- the metamethods are resolved when the metatype is set
+
+ffi.cdef [[
+    typedef struct bar {
+        int x;
+    } bar;
+]]
+
+local bar_mt = {
+    __index = {},
+    __len = function(self) return self.x end,
+}
+local bar = ffi.metatype("bar", bar_mt)
+
+local b = bar(3)
+assert(#b == 3)
+bar_mt.__len = function() return 0 end
+assert(#b == 3)
+-- the index table is the same table
+bar_mt.__index.twice = function(self) return self.x * 2 end
+assert(b:twice() == 6)
+-- and it works through pointers too
+local bp = ffi.cast("bar *", b)
+assert(#bp == 3)
+assert(bp:twice() == 6)
@@ -0,0 +1,59 @@
+local ffi = require("cffi")
+
+local st = ffi.pool()
+assert(not st.enabled)
+assert(st.hits == 0)
+
+st = ffi.pool(true)
+assert(st.enabled)
+
+-- boxed 64-bit results are short-lived, so their blocks get reused
+local x = ffi.new("long long", 0)
+for i = 1, 10000 do
+    x = x + 1
+end
+assert(x == ffi.new("long long", 10000))
+collectgarbage()
+x = x + 1
+
+st = ffi.pool()
+assert(st.hits > 0)
+
+-- freed blocks go into the pool and come back out for new allocations
+collectgarbage("stop")
+local keep = {}
+for i = 1, 32 do
+    keep[i] = ffi.new("long long", i)
+end
+local before = ffi.pool().cached
+keep = nil
+collectgarbage()
+collectgarbage("stop")
+local freed = ffi.pool()
+assert(freed.cached > before)
+keep = {}
+for i = 1, 32 do
+    keep[i] = ffi.new("long long", i)
+end
+st = ffi.pool()
+assert(st.cached < freed.cached)
+assert(st.hits >= freed.hits + 32)
+keep = nil
+collectgarbage("restart")
+
+-- disabling hands everything back to the allocator
+st = ffi.pool(false)
+assert(not st.enabled)
+assert(st.cached == 0)
+
+for i = 1, 1000 do
+    x = x + 1
+end
+collectgarbage()
+
+-- and it can be turned on again
+assert(ffi.pool(true).enabled)
+for i = 1, 1000 do
+    x = x + 1
+end
+collectgarbage()
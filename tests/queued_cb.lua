@@ -0,0 +1,56 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    void *test_thread_start(int (*cb)(int), int n);
+    int test_thread_join(void *t);
+]]
+
+-- the thread waits for each result
+
+local cb = ffi.cast("int (*)(int)", function(x) return x * 2 end)
+cb:queue()
+local th = ffi.C.test_thread_start(cb, 10)
+local n = 0
+while n < 10 do
+    n = n + ffi.dispatch()
+end
+assert(ffi.C.test_thread_join(th) == 110)
+assert(ffi.dispatch() == 0)
+
+-- calls from the owning thread are not queued
+
+assert(cb(5) == 10)
+
+-- fire and forget, the thread gets zero results
+
+local seen = 0
+local cb2 = ffi.cast("int (*)(int)", function(x) seen = seen + x; return 1 end)
+cb2:queue(false)
+th = ffi.C.test_thread_start(cb2, 10)
+assert(ffi.C.test_thread_join(th) == 0)
+assert(ffi.dispatch(4) == 4)
+assert(seen == 10)
+assert(ffi.dispatch() == 6)
+assert(seen == 55)
+
+-- errors are propagated and the waiting thread is let go
+
+local cb3 = ffi.cast("int (*)(int)", function(x) error("boom") end)
+cb3:queue()
+th = ffi.C.test_thread_start(cb3, 1)
+local ok, err
+repeat
+    ok, err = pcall(ffi.dispatch)
+until not ok
+assert(err:match("boom"))
+assert(ffi.C.test_thread_join(th) == 0)
+
+-- freeing a callback drops its pending invocations
+
+th = ffi.C.test_thread_start(cb2, 5)
+ffi.C.test_thread_join(th)
+cb2:free()
+assert(ffi.dispatch() == 0)
+
+cb:free()
+cb3:free()
@@ -34,3 +34,18 @@ ffi.cdef [[
 ]]
 
 assert(tostring(ffi.typeof("foo")) == "ctype<struct foo>")
+
+-- string types are cached, but later declarations must still be seen
+assert(not pcall(ffi.sizeof, "baz_t"))
+ffi.cdef [[
+    struct baz { int x; };
+    typedef struct baz baz_t;
+]]
+assert(ffi.sizeof("baz_t") == ffi.sizeof("int"))
+assert(ffi.sizeof("struct baz *") == ffi.sizeof("void *"))
+assert(ffi.typeof("struct baz") == ffi.typeof("baz_t"))
+
+-- lines in comments count towards error positions
+local ok, err = pcall(ffi.cdef, "/* one\n * two\r\n */ struct baz { int y; };")
+assert(not ok)
+assert(err:find("input:3:"))
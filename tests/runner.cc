@@ -1,5 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
+#include <thread>
+#include <chrono>
 
 #include <lua.hh>
 
@@ -55,14 +57,64 @@ int TEST_FASTCALL test_fastcall(int a, int b) {
     return a + b;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        printf("not enough arguments (%d)\n", argc);
-        return 1;
-    }
-    /* set up a lua state */
-    auto L = luaL_newstate();
-    luaL_openlibs(L);
+/* a finalizer which keeps track of what it released */
+static int test_released = 0;
+
+extern "C" DLL_EXPORT
+void test_release(int *p) {
+    test_released += *p;
+}
+
+extern "C" DLL_EXPORT
+int test_released_sum(void) {
+    return test_released;
+}
+
+/* something that takes a while, for asynchronous calls */
+extern "C" DLL_EXPORT
+int test_slow_add(int a, int b, int ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    return a + b;
+}
+
+struct test_point {
+    int x, y;
+};
+
+extern "C" DLL_EXPORT
+int test_point_sum(test_point p) {
+    return p.x + p.y;
+}
+
+/* calls the callback from another thread, for queued callbacks */
+struct test_thread {
+    std::thread thr;
+    int sum;
+};
+
+extern "C" DLL_EXPORT
+void *test_thread_start(int (*cb)(int), int n) {
+    auto *t = new test_thread{};
+    t->thr = std::thread{[t, cb, n]() {
+        for (int i = 1; i <= n; ++i) {
+            t->sum += cb(i);
+        }
+    }};
+    return t;
+}
+
+extern "C" DLL_EXPORT
+int test_thread_join(void *p) {
+    auto *t = static_cast<test_thread *>(p);
+    t->thr.join();
+    int ret = t->sum;
+    delete t;
+    return ret;
+}
+
+static char const *module_path = nullptr;
+
+static void setup_package(lua_State *L) {
     /* we need a controlled environment */
     lua_getglobal(L, "package");
 #ifdef CFFI_STATIC
@@ -71,7 +123,7 @@ int main(int argc, char **argv) {
     lua_setfield(L, -2, "cffi");
     lua_pop(L, 1);
 #else
-    lua_pushstring(L, argv[1]);
+    lua_pushstring(L, module_path);
     lua_pushstring(L, LUA_DIRSEP);
 #ifdef FFI_WINDOWS_ABI
     lua_pushstring(L, "?.dll");
@@ -82,6 +134,54 @@ int main(int argc, char **argv) {
     lua_setfield(L, -2, "cpath");
 #endif
     lua_pop(L, 1);
+}
+
+/* run_isolated(code, ...)
+ *
+ * runs the code in a fresh lua state, passing it the given strings; this is
+ * for things that need a module state not touched by the rest of the test
+ */
+static int run_isolated(lua_State *L) {
+    size_t len;
+    char const *code = luaL_checklstring(L, 1, &len);
+    int nargs = lua_gettop(L) - 1;
+    for (int i = 0; i < nargs; ++i) {
+        luaL_checkstring(L, i + 2);
+    }
+    auto LL = luaL_newstate();
+    luaL_openlibs(LL);
+    setup_package(LL);
+    bool ok = !luaL_loadbuffer(LL, code, len, "=isolated");
+    if (ok) {
+        for (int i = 0; i < nargs; ++i) {
+            size_t alen;
+            char const *arg = lua_tolstring(L, i + 2, &alen);
+            lua_pushlstring(LL, arg, alen);
+        }
+        ok = !lua_pcall(LL, nargs, 0, 0);
+    }
+    if (!ok) {
+        lua_pushstring(L, lua_tostring(LL, -1));
+        lua_close(LL);
+        return lua_error(L);
+    }
+    lua_close(LL);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("not enough arguments (%d)\n", argc);
+        return 1;
+    }
+    module_path = argv[1];
+    /* set up a lua state */
+    auto L = luaL_newstate();
+    luaL_openlibs(L);
+    setup_package(L);
+
+    lua_pushcfunction(L, run_isolated);
+    lua_setglobal(L, "run_isolated");
 
     /* this will be useful */
     lua_pushcfunction(L, [](lua_State *LL) -> int {
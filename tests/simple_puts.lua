@@ -6,3 +6,6 @@ ffi.cdef [[
 
 local ret = ffi.C.test_puts("hello world")
 assert(ret >= 0)
+
+-- function cdata are cached per library
+assert(rawequal(ffi.C.test_puts, ffi.C.test_puts))
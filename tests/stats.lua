@@ -0,0 +1,87 @@
+local ffi = require("cffi")
+
+ffi.cdef [[
+    typedef struct stats_pt { int x, y; } stats_pt;
+]]
+
+-- off by default; nothing gets counted
+
+local st = ffi.stats()
+assert(not st.enabled)
+local a = ffi.new("stats_pt")
+st = ffi.stats()
+assert(st.live == 0 and st.allocs == 0)
+assert(next(st.types) == nil)
+
+-- live count and bytes per type
+
+st = ffi.stats(true)
+assert(st.enabled)
+local keep = {}
+for i = 1, 10 do
+    keep[i] = ffi.new("stats_pt", i, i)
+end
+st = ffi.stats()
+local pt = st.types["struct stats_pt"]
+assert(pt.live == 10 and pt.allocs == 10)
+assert(pt.bytes >= 10 * ffi.sizeof("stats_pt"))
+assert(st.live >= 10 and st.allocs >= 10)
+assert(st.rate >= 0 and st.elapsed >= 0)
+
+keep = nil
+collectgarbage()
+collectgarbage()
+pt = ffi.stats().types["struct stats_pt"]
+assert(pt.live == 0 and pt.bytes == 0 and pt.allocs == 10)
+
+-- finalizers pending
+
+local f1 = ffi.gc(ffi.new("stats_pt"), function() end)
+local f2 = ffi.gc(ffi.new("stats_pt"), function() end)
+assert(ffi.stats().finalizers == 2)
+ffi.gc(f2, nil)
+assert(ffi.stats().finalizers == 1)
+f1, f2 = nil, nil
+collectgarbage()
+collectgarbage()
+assert(ffi.stats().finalizers == 0)
+
+-- closures alive
+
+local nclo = ffi.stats().closures
+local cb = ffi.cast("int (*)(int)", function(x) return x end)
+assert(ffi.stats().closures == nclo + 1)
+cb:free()
+assert(ffi.stats().closures == nclo)
+
+-- big arrays count their mapped memory too
+
+local big = ffi.new("char[?]", 2 * 1024 * 1024)
+local ent = ffi.stats().types["char [?]"]
+assert(ent and ent.live == 1 and ent.bytes >= 2 * 1024 * 1024)
+big = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.stats().types["char [?]"].bytes == 0)
+
+-- cdata made while it was on are still taken off after turning it off
+
+local late = ffi.new("stats_pt")
+st = ffi.stats(false)
+assert(not st.enabled)
+assert(st.types["struct stats_pt"].live == 1)
+ffi.new("stats_pt")
+assert(ffi.stats().types["struct stats_pt"].allocs == 13)
+late = nil
+collectgarbage()
+collectgarbage()
+assert(ffi.stats().types["struct stats_pt"].live == 0)
+
+-- turning it back on starts a new period
+
+st = ffi.stats(true)
+assert(st.allocs == 0)
+assert(st.types["struct stats_pt"] == nil)
+ffi.new("stats_pt")
+assert(ffi.stats().types["struct stats_pt"].allocs == 1)
+ffi.stats(false)
@@ -104,3 +104,19 @@ if ffi.abi("le") then
 else
     assert(x.z == 0x50A)
 end
+
+-- structs passed by value to C functions
+
+ffi.cdef [[
+    typedef struct test_point { int x, y; } test_point;
+    int test_point_sum(test_point p);
+]]
+
+local pt = ffi.new("test_point", 3, 4)
+assert(ffi.C.test_point_sum(pt) == 7)
+-- the callee gets a copy
+pt.x = 10
+assert(ffi.C.test_point_sum(pt) == 14)
+assert(pt.x == 10 and pt.y == 4)
+-- only the same struct type is accepted
+assert(not pcall(ffi.C.test_point_sum, ffi.new("union bar")))
@@ -18,3 +18,13 @@ assert(ffi.string(buf) == "123456")
 local ret = ffi.C.test_snprintf(buf, bufs, "%s %g", "hello", 3.14)
 assert(ret == 10)
 assert(ffi.string(buf) == "hello 3.14")
+
+-- alternating argument shapes exercise the prepared signature cache
+for i = 1, 10 do
+    local ret = ffi.C.test_snprintf(buf, bufs, "%d", ffi.new("int", i))
+    assert(ffi.string(buf) == tostring(i))
+    ret = ffi.C.test_snprintf(buf, bufs, "%g %s", i + 0.5, "x")
+    assert(ffi.string(buf) == tostring(i + 0.5) .. " x")
+    ret = ffi.C.test_snprintf(buf, bufs, "%s %s %s %s", "a", "b", "c", "d")
+    assert(ret == 7)
+end